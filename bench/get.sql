@@ -0,0 +1,17 @@
+-- GET benchmark, for pgbench, against bench/mock_server.py.
+--
+-- With tls=1 the CA file is set once per client, so that HTTPS
+-- runs verify the mock server's certificate like a real one. The
+-- server and CA file are given already quoted, as pgbench does not
+-- quote variables itself:
+--
+--   pgbench -n -c 4 -T 30 -f bench/get.sql \
+--     -D server="'http://127.0.0.1:18080'" -D tls=0 -D cafile="''" -D configured=0 mydb
+--
+\if :configured = 0
+\if :tls
+SELECT http_set_curlopt('CURLOPT_CAINFO', :cafile);
+\endif
+\set configured 1
+\endif
+SELECT status FROM http_get(:server || '/get');
@@ -0,0 +1,15 @@
+-- Header parsing microbenchmark, for pgbench.
+--
+-- Fetches a response carrying 40 headers from a local httpbin,
+-- so that the time is dominated by building the headers array
+-- rather than by the network. Compare the transaction rate of
+-- two builds with the following, where the server is given
+-- already quoted, as pgbench does not quote variables itself:
+--
+--   pgbench -n -c 1 -T 30 -f bench/headers.sql -D server="'http://localhost:8080'" mydb
+--
+\set n 40
+SELECT cardinality(headers)
+  FROM http_head(:server || '/response-headers?'
+       || (SELECT string_agg('X-Bench-' || i || '=value-' || i, '&')
+             FROM generate_series(1, :n) AS i));
@@ -0,0 +1,123 @@
+#!/usr/bin/env python3
+"""
+Loopback HTTP(S) server for benchmarking the http extension.
+
+Every path answers, GET and HEAD with a body of --size bytes and
+POST and PUT by reading the request body and answering the same
+way, after sleeping for --latency milliseconds (plus up to
+--jitter more). The status of each response is drawn from
+--status-mix, given as status=weight pairs. A query string can
+override any of these for one request:
+
+    /anything?latency=250&size=65536&status=503
+
+Connections are kept alive, so the extension's connection reuse
+is measured rather than the server's connect rate. With --cert
+and --key the server speaks HTTPS.
+"""
+
+import argparse
+import random
+import ssl
+import sys
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import parse_qs, urlsplit
+
+
+def parse_mix(text):
+    mix = []
+    for item in text.split(","):
+        status, _, weight = item.strip().partition("=")
+        mix.append((int(status), float(weight or 1)))
+    return mix
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    server_version = "pgsql-http-bench"
+
+    def log_message(self, format, *args):
+        pass
+
+    def respond(self, head_only=False):
+        opts = self.server.opts
+        query = {k: v[-1] for k, v in parse_qs(urlsplit(self.path).query).items()}
+
+        latency = float(query.get("latency", opts.latency))
+        if opts.jitter:
+            latency += random.uniform(0, opts.jitter)
+        if latency > 0:
+            time.sleep(latency / 1000.0)
+
+        if "status" in query:
+            status = int(query["status"])
+        else:
+            statuses, weights = zip(*opts.mix)
+            status = random.choices(statuses, weights)[0]
+
+        size = int(query.get("size", opts.size))
+        self.send_response(status)
+        self.send_header("Content-Type", "text/plain")
+        self.send_header("Content-Length", str(size))
+        self.send_header("Cache-Control", "no-store")
+        self.end_headers()
+        if not head_only and size:
+            self.wfile.write(self.server.body[:size] if size <= len(self.server.body) else b"x" * size)
+
+    def read_body(self):
+        length = int(self.headers.get("Content-Length") or 0)
+        if length:
+            self.rfile.read(length)
+
+    def do_GET(self):
+        self.respond()
+
+    def do_HEAD(self):
+        self.respond(head_only=True)
+
+    def do_POST(self):
+        self.read_body()
+        self.respond()
+
+    def do_PUT(self):
+        self.read_body()
+        self.respond()
+
+    def do_DELETE(self):
+        self.respond()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=18080)
+    parser.add_argument("--latency", type=float, default=0, help="milliseconds before each response")
+    parser.add_argument("--jitter", type=float, default=0, help="up to this many more milliseconds")
+    parser.add_argument("--size", type=int, default=1024, help="bytes in each response body")
+    parser.add_argument("--status-mix", default="200=1", help="e.g. 200=95,503=5")
+    parser.add_argument("--cert", help="PEM certificate, to serve HTTPS")
+    parser.add_argument("--key", help="PEM private key of the certificate")
+    opts = parser.parse_args()
+    opts.mix = parse_mix(opts.status_mix)
+
+    server = ThreadingHTTPServer((opts.host, opts.port), Handler)
+    server.daemon_threads = True
+    server.opts = opts
+    server.body = b"x" * max(opts.size, 1 << 20)
+
+    if opts.cert:
+        context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+        context.load_cert_chain(opts.cert, opts.key)
+        server.socket = context.wrap_socket(server.socket, server_side=True)
+
+    scheme = "https" if opts.cert else "http"
+    print("listening on %s://%s:%d" % (scheme, opts.host, opts.port), file=sys.stderr, flush=True)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,15 @@
+-- POST benchmark, for pgbench, against bench/mock_server.py.
+--
+-- Sends a form-encoded body of :bytes bytes. The server and CA
+-- file are given already quoted, as for bench/get.sql:
+--
+--   pgbench -n -c 4 -T 30 -f bench/post.sql \
+--     -D server="'http://127.0.0.1:18080'" -D tls=0 -D cafile="''" -D configured=0 -D bytes=1024 mydb
+--
+\if :configured = 0
+\if :tls
+SELECT http_set_curlopt('CURLOPT_CAINFO', :cafile);
+\endif
+\set configured 1
+\endif
+SELECT status FROM http_post(:server || '/post', 'data=' || repeat('x', :bytes - 5), 'application/x-www-form-urlencoded');
@@ -0,0 +1,137 @@
+#!/bin/sh
+#
+# End-to-end benchmark of the http extension against a local mock
+# server. Starts bench/mock_server.py, then runs the GET and POST
+# pgbench scripts at each client count and reports throughput,
+# p50/p99 latency and the backend CPU time spent per call.
+#
+# Run it on the database host, as a user who can read the data
+# directory, against a database with the extension installed:
+#
+#   make bench BENCH_DB=mydb
+#   CLIENTS="1 8 32" LATENCY=20 SIZE=65536 TLS=1 bench/run.sh mydb
+#
+# Settings, from the environment:
+#
+#   CLIENTS      client counts to run, "1 4 16"
+#   DURATION     seconds per run, 20
+#   SCRIPTS      pgbench scripts to run, "get post"
+#   LATENCY      server latency in milliseconds, 0
+#   JITTER       extra random latency in milliseconds, 0
+#   SIZE         response body bytes, 1024
+#   POST_BYTES   request body bytes for post, 1024
+#   STATUS_MIX   response statuses and weights, "200=1"
+#   TLS          1 to serve HTTPS with a throwaway certificate, 0
+#   PORT         mock server port, 18080
+#   PYTHON       python3
+#
+# The CPU time is the growth in the postmaster's reaped-children
+# time over a run, read from /proc once the run's backends have
+# exited and been reaped, so it is only reported on Linux and
+# includes any other backends that exit meanwhile.
+
+set -e
+
+DB=${1:-${BENCH_DB:-${PGDATABASE:-postgres}}}
+CLIENTS=${CLIENTS:-"1 4 16"}
+DURATION=${DURATION:-20}
+SCRIPTS=${SCRIPTS:-"get post"}
+LATENCY=${LATENCY:-0}
+JITTER=${JITTER:-0}
+SIZE=${SIZE:-1024}
+POST_BYTES=${POST_BYTES:-1024}
+STATUS_MIX=${STATUS_MIX:-"200=1"}
+TLS=${TLS:-0}
+PORT=${PORT:-18080}
+PYTHON=${PYTHON:-python3}
+
+BENCH=$(cd "$(dirname "$0")" && pwd)
+WORK=$(mktemp -d)
+SERVER_PID=
+
+cleanup() {
+	[ -n "$SERVER_PID" ] && kill "$SERVER_PID" 2>/dev/null
+	rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+SCHEME=http
+CAFILE=
+SERVER_TLS=
+if [ "$TLS" = 1 ]; then
+	SCHEME=https
+	CAFILE="$WORK/cert.pem"
+	openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj "/CN=localhost" \
+		-addext "subjectAltName=DNS:localhost,IP:127.0.0.1" \
+		-keyout "$WORK/key.pem" -out "$CAFILE" 2>/dev/null
+	SERVER_TLS="--cert $CAFILE --key $WORK/key.pem"
+fi
+
+"$PYTHON" "$BENCH/mock_server.py" --port "$PORT" --latency "$LATENCY" --jitter "$JITTER" \
+	--size "$SIZE" --status-mix "$STATUS_MIX" $SERVER_TLS &
+SERVER_PID=$!
+sleep 1
+kill -0 "$SERVER_PID" 2>/dev/null || { echo "mock server did not start" >&2; exit 1; }
+
+psql -X -q -d "$DB" -c "CREATE EXTENSION IF NOT EXISTS http" >/dev/null
+
+# CPU ticks of the backends that have exited, as counted by the postmaster
+DATADIR=$(psql -X -At -d "$DB" -c "SHOW data_directory" 2>/dev/null || true)
+POSTMASTER=$(head -1 "$DATADIR/postmaster.pid" 2>/dev/null || true)
+TICKS=$(getconf CLK_TCK 2>/dev/null || echo 100)
+child_ticks() {
+	if [ -n "$POSTMASTER" ] && [ -r "/proc/$POSTMASTER/stat" ]; then
+		# Skip past the command name, which may hold spaces
+		sed 's/^.*) //' "/proc/$POSTMASTER/stat" | awk '{ print $14 + $15 }'
+	fi
+}
+
+# Backends of the running pgbench
+pgbench_backends() {
+	psql -X -At -d "$DB" -c "SELECT pid FROM pg_stat_activity WHERE application_name = 'pgbench'"
+}
+
+printf "%-6s %7s %10s %10s %10s %12s\n" script clients tps p50_ms p99_ms cpu_ms/call
+for script in $SCRIPTS; do
+	for clients in $CLIENTS; do
+		rm -f "$WORK"/pgbench_log.*
+		before=$(child_ticks)
+		# pgbench substitutes variables as they are, so strings go in quoted
+		(cd "$WORK" && pgbench -n -c "$clients" -j "$clients" -T "$DURATION" -l \
+			-f "$BENCH/$script.sql" \
+			-D server="'$SCHEME://localhost:$PORT'" -D tls="$TLS" -D cafile="'$CAFILE'" \
+			-D configured=0 -D bytes="$POST_BYTES" \
+			"$DB" > "$WORK/pgbench.out") &
+		PGBENCH_PID=$!
+
+		# Note the backends, to wait for them to be reaped at the end
+		pids=
+		while kill -0 "$PGBENCH_PID" 2>/dev/null && [ "$(echo $pids | wc -w)" -lt "$clients" ]; do
+			sleep 0.2
+			pids=$(pgbench_backends)
+		done
+		wait "$PGBENCH_PID"
+
+		# Their CPU time reaches the postmaster only once it has reaped
+		# them, and until then they linger in /proc
+		for pid in $pids; do
+			while [ -e "/proc/$pid" ]; do
+				sleep 0.1
+			done
+		done
+		after=$(child_ticks)
+
+		tps=$(sed -n 's/^tps = \([0-9.]*\).*/\1/p' "$WORK/pgbench.out" | tail -1)
+		# The third field of each log line is the latency in microseconds
+		cat "$WORK"/pgbench_log.* | awk '{ print $3 }' | sort -n > "$WORK/latencies"
+		calls=$(wc -l < "$WORK/latencies")
+		p50=$(awk -v n="$calls" 'NR == int(n * 0.50) + 1 { printf "%.2f", $1 / 1000 }' "$WORK/latencies")
+		p99=$(awk -v n="$calls" 'NR == int(n * 0.99) + 1 { printf "%.2f", $1 / 1000 }' "$WORK/latencies")
+		cpu=-
+		if [ -n "$before" ] && [ -n "$after" ] && [ "$calls" -gt 0 ]; then
+			cpu=$(awk -v t="$((after - before))" -v hz="$TICKS" -v n="$calls" \
+				'BEGIN { printf "%.3f", t * 1000 / hz / n }')
+		fi
+		printf "%-6s %7s %10s %10s %10s %12s\n" "$script" "$clients" "$tps" "$p50" "$p99" "$cpu"
+	done
+done
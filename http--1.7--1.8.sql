@@ -0,0 +1,325 @@
+
+CREATE FUNCTION http_multi(requests @extschema@.http_request[], max_concurrency INTEGER DEFAULT 8)
+    RETURNS TABLE(ordinality INTEGER, response @extschema@.http_response)
+    AS 'MODULE_PATHNAME', 'http_multi'
+    LANGUAGE 'c'
+    STRICT;
+
+CREATE TABLE http_request_queue (
+    id BIGSERIAL PRIMARY KEY,
+    request @extschema@.http_request NOT NULL,
+    attempts INTEGER NOT NULL DEFAULT 0,
+    worker_pid INTEGER,
+    created TIMESTAMPTZ NOT NULL DEFAULT now(),
+    started TIMESTAMPTZ
+);
+
+CREATE TABLE http_response_queue (
+    id BIGINT PRIMARY KEY,
+    request @extschema@.http_request,
+    response @extschema@.http_response,
+    error TEXT,
+    attempts INTEGER,
+    created TIMESTAMPTZ,
+    completed TIMESTAMPTZ NOT NULL DEFAULT now()
+);
+
+SELECT pg_catalog.pg_extension_config_dump('http_request_queue', '');
+SELECT pg_catalog.pg_extension_config_dump('http_request_queue_id_seq', '');
+SELECT pg_catalog.pg_extension_config_dump('http_response_queue', '');
+
+CREATE FUNCTION http_enqueue(request @extschema@.http_request)
+    RETURNS BIGINT
+    AS 'MODULE_PATHNAME', 'http_enqueue'
+    LANGUAGE 'c'
+    STRICT;
+
+CREATE FUNCTION http_pool_stats(OUT pooled BOOLEAN, OUT requests BIGINT, OUT connections_opened BIGINT, OUT connections_reused BIGINT)
+    AS 'MODULE_PATHNAME', 'http_pool_stats'
+    LANGUAGE 'c';
+
+CREATE FUNCTION http_dns_cache_entries(OUT host TEXT, OUT port INTEGER, OUT address TEXT, OUT expires TIMESTAMPTZ, OUT hits BIGINT)
+    RETURNS SETOF record
+    AS 'MODULE_PATHNAME', 'http_dns_cache_entries'
+    LANGUAGE 'c';
+
+CREATE VIEW http_dns_cache AS
+    SELECT * FROM @extschema@.http_dns_cache_entries();
+
+CREATE FUNCTION http_dns_cache_reset()
+    RETURNS VOID
+    AS 'MODULE_PATHNAME', 'http_dns_cache_reset'
+    LANGUAGE 'c';
+
+REVOKE ALL ON FUNCTION http_dns_cache_reset() FROM PUBLIC;
+
+CREATE FUNCTION http_stream(request @extschema@.http_request, chunk_size INTEGER DEFAULT 65536)
+    RETURNS SETOF BYTEA
+    AS 'MODULE_PATHNAME', 'http_stream'
+    LANGUAGE 'c'
+    STRICT;
+
+CREATE FUNCTION http_stream_lines(request @extschema@.http_request)
+    RETURNS SETOF TEXT
+    AS 'MODULE_PATHNAME', 'http_stream_lines'
+    LANGUAGE 'c'
+    STRICT;
+
+CREATE FUNCTION http_get_lines(uri VARCHAR)
+    RETURNS SETOF TEXT
+    AS $$ SELECT @extschema@.http_stream_lines(('GET', $1, NULL, NULL, NULL)::@extschema@.http_request) $$
+    LANGUAGE 'sql';
+
+CREATE FUNCTION http_stream_ndjson(request @extschema@.http_request)
+    RETURNS SETOF JSONB
+    AS 'MODULE_PATHNAME', 'http_stream_ndjson'
+    LANGUAGE 'c'
+    STRICT;
+
+CREATE FUNCTION http_get_ndjson(uri VARCHAR)
+    RETURNS SETOF JSONB
+    AS $$ SELECT @extschema@.http_stream_ndjson(('GET', $1, NULL, NULL, NULL)::@extschema@.http_request) $$
+    LANGUAGE 'sql';
+
+CREATE TYPE http_request_bytea AS (
+    method http_method,
+    uri VARCHAR,
+    headers http_header[],
+    content_type VARCHAR,
+    content BYTEA
+);
+
+CREATE FUNCTION http_send(request @extschema@.http_request_bytea)
+    RETURNS http_response
+    AS 'MODULE_PATHNAME', 'http_request'
+    LANGUAGE 'c';
+
+CREATE FUNCTION http_post(uri VARCHAR, content BYTEA, content_type VARCHAR)
+    RETURNS http_response
+    AS $$ SELECT @extschema@.http_send(('POST', $1, NULL, $3, $2)::@extschema@.http_request_bytea) $$
+    LANGUAGE 'sql';
+
+CREATE FUNCTION http_put(uri VARCHAR, content BYTEA, content_type VARCHAR)
+    RETURNS http_response
+    AS $$ SELECT @extschema@.http_send(('PUT', $1, NULL, $3, $2)::@extschema@.http_request_bytea) $$
+    LANGUAGE 'sql';
+
+CREATE FUNCTION http_patch(uri VARCHAR, content BYTEA, content_type VARCHAR)
+    RETURNS http_response
+    AS $$ SELECT @extschema@.http_send(('PATCH', $1, NULL, $3, $2)::@extschema@.http_request_bytea) $$
+    LANGUAGE 'sql';
+
+CREATE TYPE http_response_bytea AS (
+    status INTEGER,
+    content_type VARCHAR,
+    headers http_header[],
+    content BYTEA
+);
+
+CREATE FUNCTION http_bytea(request @extschema@.http_request)
+    RETURNS http_response_bytea
+    AS 'MODULE_PATHNAME', 'http_request'
+    LANGUAGE 'c';
+
+CREATE FUNCTION http_get_bytea(uri VARCHAR)
+    RETURNS http_response_bytea
+    AS $$ SELECT @extschema@.http_bytea(('GET', $1, NULL, NULL, NULL)::@extschema@.http_request) $$
+    LANGUAGE 'sql';
+
+CREATE FUNCTION http_to_lo(request @extschema@.http_request)
+    RETURNS OID
+    AS 'MODULE_PATHNAME', 'http_to_lo'
+    LANGUAGE 'c'
+    STRICT;
+
+CREATE FUNCTION http_from_lo(request @extschema@.http_request, lo OID)
+    RETURNS http_response
+    AS 'MODULE_PATHNAME', 'http_from_lo'
+    LANGUAGE 'c'
+    STRICT;
+
+CREATE FUNCTION http_get_lo(uri VARCHAR)
+    RETURNS OID
+    AS $$ SELECT @extschema@.http_to_lo(('GET', $1, NULL, NULL, NULL)::@extschema@.http_request) $$
+    LANGUAGE 'sql';
+
+CREATE FUNCTION http_put_lo(uri VARCHAR, lo OID, content_type VARCHAR)
+    RETURNS http_response
+    AS $$ SELECT @extschema@.http_from_lo(('PUT', $1, NULL, $3, '')::@extschema@.http_request, $2) $$
+    LANGUAGE 'sql';
+
+CREATE FUNCTION http_prepare(name TEXT, request @extschema@.http_request)
+    RETURNS VOID
+    AS 'MODULE_PATHNAME', 'http_prepare'
+    LANGUAGE 'c'
+    STRICT;
+
+CREATE FUNCTION http_execute(name TEXT, path TEXT DEFAULT NULL, content TEXT DEFAULT NULL)
+    RETURNS http_response
+    AS 'MODULE_PATHNAME', 'http_execute'
+    LANGUAGE 'c';
+
+CREATE FUNCTION http_deallocate(name TEXT DEFAULT NULL)
+    RETURNS VOID
+    AS 'MODULE_PATHNAME', 'http_deallocate'
+    LANGUAGE 'c';
+
+CREATE FUNCTION http_cache_stats(OUT entries BIGINT, OUT bytes BIGINT, OUT hits BIGINT, OUT misses BIGINT, OUT stores BIGINT, OUT evictions BIGINT)
+    AS 'MODULE_PATHNAME', 'http_cache_stats'
+    LANGUAGE 'c';
+
+CREATE FUNCTION http_cache_invalidate(uri_pattern TEXT)
+    RETURNS BIGINT
+    AS 'MODULE_PATHNAME', 'http_cache_invalidate'
+    LANGUAGE 'c'
+    STRICT;
+
+REVOKE ALL ON FUNCTION http_cache_invalidate(TEXT) FROM PUBLIC;
+
+CREATE TABLE http_response_cache (
+    owner NAME NOT NULL DEFAULT current_user,
+    uri VARCHAR NOT NULL,
+    etag TEXT,
+    last_modified TEXT,
+    response @extschema@.http_response NOT NULL,
+    validated TIMESTAMPTZ NOT NULL DEFAULT now(),
+    PRIMARY KEY (owner, uri)
+);
+
+-- Each role sees and stores only its own responses
+ALTER TABLE http_response_cache ENABLE ROW LEVEL SECURITY;
+CREATE POLICY http_response_cache_owner ON http_response_cache
+    USING (owner = current_user)
+    WITH CHECK (owner = current_user);
+GRANT SELECT, INSERT, UPDATE, DELETE ON http_response_cache TO PUBLIC;
+
+CREATE FUNCTION http_get_cached(uri VARCHAR)
+    RETURNS http_response
+    AS $$
+DECLARE
+    cached @extschema@.http_response_cache;
+    conditions @extschema@.http_header[];
+    fetched @extschema@.http_response;
+    new_etag TEXT;
+    new_last_modified TEXT;
+BEGIN
+    SELECT * INTO cached FROM @extschema@.http_response_cache c
+        WHERE c.owner = current_user AND c.uri = http_get_cached.uri;
+    IF cached.etag IS NOT NULL THEN
+        conditions := conditions || @extschema@.http_header('If-None-Match', cached.etag);
+    END IF;
+    IF cached.last_modified IS NOT NULL THEN
+        conditions := conditions || @extschema@.http_header('If-Modified-Since', cached.last_modified);
+    END IF;
+
+    fetched := @extschema@.http(('GET', http_get_cached.uri, conditions, NULL, NULL)::@extschema@.http_request);
+
+    -- Not modified, so the stored response still stands
+    IF fetched.status = 304 AND cached.uri IS NOT NULL THEN
+        UPDATE @extschema@.http_response_cache c SET validated = now()
+            WHERE c.owner = current_user AND c.uri = http_get_cached.uri;
+        RETURN cached.response;
+    END IF;
+
+    IF fetched.status = 200 THEN
+        SELECT max(h.value) FILTER (WHERE lower(h.field) = 'etag'),
+               max(h.value) FILTER (WHERE lower(h.field) = 'last-modified')
+          INTO new_etag, new_last_modified
+          FROM unnest(fetched.headers) AS h;
+
+        -- Without a validator there is nothing to revalidate with
+        IF new_etag IS NULL AND new_last_modified IS NULL THEN
+            DELETE FROM @extschema@.http_response_cache c
+                WHERE c.owner = current_user AND c.uri = http_get_cached.uri;
+        ELSE
+            INSERT INTO @extschema@.http_response_cache (uri, etag, last_modified, response)
+                VALUES (http_get_cached.uri, new_etag, new_last_modified, fetched)
+                ON CONFLICT ON CONSTRAINT http_response_cache_pkey DO UPDATE
+                SET etag = EXCLUDED.etag,
+                    last_modified = EXCLUDED.last_modified,
+                    response = EXCLUDED.response,
+                    validated = EXCLUDED.validated;
+        END IF;
+    END IF;
+
+    RETURN fetched;
+END;
+$$
+LANGUAGE 'plpgsql';
+
+CREATE FUNCTION http_circuit_entries(OUT host TEXT, OUT state TEXT, OUT failures INTEGER, OUT opened TIMESTAMPTZ)
+    RETURNS SETOF record
+    AS 'MODULE_PATHNAME', 'http_circuit_entries'
+    LANGUAGE 'c';
+
+CREATE VIEW http_circuit_state AS
+    SELECT * FROM @extschema@.http_circuit_entries();
+
+CREATE FUNCTION http_circuit_reset(host TEXT DEFAULT NULL)
+    RETURNS VOID
+    AS 'MODULE_PATHNAME', 'http_circuit_reset'
+    LANGUAGE 'c';
+
+REVOKE ALL ON FUNCTION http_circuit_reset(TEXT) FROM PUBLIC;
+
+CREATE FUNCTION http(request @extschema@.http_request, max_retries INTEGER)
+    RETURNS http_response
+    AS 'MODULE_PATHNAME', 'http_request'
+    LANGUAGE 'c';
+
+CREATE FUNCTION http_stats_entries(OUT host TEXT, OUT requests BIGINT,
+        OUT status_1xx BIGINT, OUT status_2xx BIGINT, OUT status_3xx BIGINT,
+        OUT status_4xx BIGINT, OUT status_5xx BIGINT,
+        OUT errors BIGINT, OUT error_codes JSONB,
+        OUT bytes_sent BIGINT, OUT bytes_received BIGINT,
+        OUT total_time DOUBLE PRECISION, OUT mean_time DOUBLE PRECISION,
+        OUT max_time DOUBLE PRECISION, OUT latency_histogram BIGINT[],
+        OUT stats_reset TIMESTAMPTZ)
+    RETURNS SETOF record
+    AS 'MODULE_PATHNAME', 'http_stats_entries'
+    LANGUAGE 'c';
+
+CREATE VIEW pg_stat_http AS
+    SELECT * FROM @extschema@.http_stats_entries();
+
+CREATE FUNCTION http_stats_reset(host TEXT DEFAULT NULL)
+    RETURNS VOID
+    AS 'MODULE_PATHNAME', 'http_stats_reset'
+    LANGUAGE 'c';
+
+REVOKE ALL ON FUNCTION http_stats_reset(TEXT) FROM PUBLIC;
+
+CREATE FUNCTION http_last_timing(OUT uri TEXT,
+        OUT namelookup_time DOUBLE PRECISION, OUT connect_time DOUBLE PRECISION,
+        OUT appconnect_time DOUBLE PRECISION, OUT pretransfer_time DOUBLE PRECISION,
+        OUT starttransfer_time DOUBLE PRECISION, OUT total_time DOUBLE PRECISION,
+        OUT redirect_time DOUBLE PRECISION, OUT redirect_count INTEGER,
+        OUT bytes_sent BIGINT, OUT bytes_received BIGINT,
+        OUT connection_reused BOOLEAN, OUT http_version TEXT)
+    RETURNS record
+    AS 'MODULE_PATHNAME', 'http_last_timing'
+    LANGUAGE 'c';
+
+CREATE FUNCTION http_parallel(request @extschema@.http_request)
+    RETURNS http_response
+    AS 'MODULE_PATHNAME', 'http_request_readonly'
+    LANGUAGE 'c'
+    PARALLEL SAFE;
+
+CREATE FUNCTION http_get_parallel(uri VARCHAR)
+    RETURNS http_response
+    AS $$ SELECT @extschema@.http_parallel(('GET', $1, NULL, NULL, NULL)::@extschema@.http_request) $$
+    LANGUAGE 'sql'
+    PARALLEL SAFE;
+
+CREATE FUNCTION http_head_parallel(uri VARCHAR)
+    RETURNS http_response
+    AS $$ SELECT @extschema@.http_parallel(('HEAD', $1, NULL, NULL, NULL)::@extschema@.http_request) $$
+    LANGUAGE 'sql'
+    PARALLEL SAFE;
+
+CREATE FUNCTION http_parse_headers(raw TEXT)
+    RETURNS http_header[]
+    AS 'MODULE_PATHNAME', 'http_parse_headers'
+    LANGUAGE 'c'
+    IMMUTABLE STRICT PARALLEL SAFE;
@@ -30,29 +30,40 @@
 /* Constants */
 #define HTTP_ENCODING "gzip"
 #define CURL_MIN_VERSION 0x071400 /* 7.20.0 */
-#define HTTP_VERSION "1.7"
+#define HTTP_VERSION "1.8"
 
 /* System */
-#include <regex.h>
+#include <ctype.h>
 #include <string.h>
 #include <stdlib.h>
 #include <limits.h>	/* INT_MAX */
 #include <signal.h> /* SIGINT */
+#include <time.h>
 
 /* PostgreSQL */
 #include <postgres.h>
+
+#if PG_VERSION_NUM < 130000
+#error "pgsql-http requires PostgreSQL 13 or later"
+#endif
+
 #include <fmgr.h>
 #include <funcapi.h>
 #include <miscadmin.h>
 #include <access/genam.h>
 #include <access/htup.h>
+#include <access/htup_details.h>
 #include <access/sysattr.h>
+#include <access/table.h>
 #include <catalog/namespace.h>
 #include <catalog/pg_type.h>
+#include <catalog/pg_collation.h>
 #include <catalog/pg_extension.h>
 #include <catalog/dependency.h>
 #include <catalog/indexing.h>
 #include <commands/extension.h>
+#include <common/hashfn.h>
+#include <lib/ilist.h>
 #include <lib/stringinfo.h>
 #include <mb/pg_wchar.h>
 #include <nodes/pg_list.h>
@@ -63,32 +74,43 @@
 #include <utils/lsyscache.h>
 #include <utils/syscache.h>
 #include <utils/typcache.h>
+#include <utils/varlena.h>
+#include <utils/tuplestore.h>
 #include <utils/fmgroids.h>
 #include <utils/guc.h>
+#include <utils/inval.h>
+#include <utils/hsearch.h>
+
+#include <utils/datum.h>
+#include <utils/dsa.h>
+#include <utils/memutils.h>
+#include <utils/snapmgr.h>
+#include <utils/timestamp.h>
+#include <access/xact.h>
+#include <executor/spi.h>
+#include <pgstat.h>
+#include <postmaster/bgworker.h>
+#include <postmaster/interrupt.h>
+#include <port/atomics.h>
+#include <libpq/libpq-fs.h>
+#include <storage/buffile.h>
+#include <storage/ipc.h>
+#include <storage/latch.h>
+#include <storage/lwlock.h>
+#include <storage/shmem.h>
+#include <storage/large_object.h>
+#include <storage/spin.h>
+#include <utils/acl.h>
+#include <tcop/tcopprot.h>
+
+#if PG_VERSION_NUM >= 150000
+#include <common/pg_prng.h>
+#endif
 
 #if PG_VERSION_NUM >= 170000
 #include <utils/wait_event.h>
 #endif
 
-#if PG_VERSION_NUM >= 90300
-#  include <access/htup_details.h>
-#endif
-
-#if PG_VERSION_NUM >= 100000
-#  include <utils/varlena.h>
-#endif
-
-#if PG_VERSION_NUM >= 120000
-#  include <access/table.h>
-#else
-#  define table_open(rel, lock) heap_open((rel), (lock))
-#  define table_close(rel, lock) heap_close((rel), (lock))
-#endif
-
-#if PG_VERSION_NUM < 110000
-#define PG_GETARG_JSONB_P(x) DatumGetJsonb(PG_GETARG_DATUM(x))
-#endif
-
 /* CURL */
 #include <curl/curl.h>
 
@@ -136,6 +158,49 @@ typedef enum {
 	HEADER_VALUE = 1
 } http_header_type;
 
+/*
+* The subtransaction that the spill files of one or more
+* transfers are made in, so that a failure to write one can
+* be rolled back, and the error raised once curl returns.
+*/
+typedef struct {
+	MemoryContext mcxt;
+	ResourceOwner owner;
+	bool active;         /* the subtransaction is open */
+	bool lost;           /* it was rolled back, closing the spill files */
+	ErrorData *error;
+} http_spill_scope;
+
+/* State of a single request/response exchange with curl */
+typedef struct {
+	CURL *handle;
+	struct curl_slist *headers;
+	StringInfoData si_data;
+	StringInfoData si_headers;
+	const char *body;    /* upload content, not copied */
+	size_t body_len;
+	size_t body_pos;
+	struct curl_slist *resolve;
+	char *uri;
+	char *host;          /* host of the uri, in lower case, or NULL */
+	http_method method;
+	int ordinality;
+	bool binary;         /* si_data starts with room for a bytea header */
+	bool too_large;      /* the body passed http.max_response_bytes */
+	size_t received;     /* bytes of body so far */
+	BufFile *spill;      /* holds the body once past http.spill_threshold */
+	http_spill_scope *spill_scope; /* where spill files are made, NULL for none */
+	bool dns_lookup;     /* host is eligible for the DNS cache */
+	bool dns_cached;     /* address came from the DNS cache */
+	bool cache_store;    /* response may go in the response cache */
+	bool circuit;        /* outcome counts for the host's circuit breaker */
+	int fallback_status; /* status to answer with instead of failing */
+	TimestampTz deferred; /* when its rate limit first held it back, or 0 */
+	TimestampTz admit_at; /* when to offer it to its rate limit again */
+	CURLcode fail_fast;  /* set to fail the transfer without running it */
+	char error_buffer[CURL_ERROR_SIZE];
+} http_transfer;
+
 /*
  * String/Long for strings and numbers, blob only for
  * CURLOPT_SSLKEY_BLOB and CURLOPT_SSLCERT_BLOB
@@ -218,11 +283,167 @@ void _PG_fini(void);
 static size_t http_writeback(void *contents, size_t size, size_t nmemb, void *userp);
 static size_t http_readback(void *buffer, size_t size, size_t nitems, void *instream);
 
+static void http_type_cache_invalidate(Datum arg, int cacheid, uint32 hashvalue);
+static void http_pool_guc_init(void);
+static void http_dns_guc_init(void);
+static void http_cache_guc_init(void);
+static void http_rate_guc_init(void);
+static void http_circuit_guc_init(void);
+static void http_retry_guc_init(void);
+static void http_stats_guc_init(void);
+static void http_response_guc_init(void);
+PGDLLEXPORT void http_worker_main(Datum main_arg);
+static void http_worker_guc_init(void);
+static void http_worker_register(void);
+static void http_shmem_request(void);
+static void http_shmem_startup(void);
+static int64 http_transfer_time(CURL *handle, CURLINFO info);
+
+/* Times are read as microseconds where curl has them so */
+#if LIBCURL_VERSION_NUM >= 0x073d00 /* 7.61.0 */
+#define HTTP_TIME_INFO(name) CURLINFO_ ## name ## _TIME_T
+#else
+#define HTTP_TIME_INFO(name) CURLINFO_ ## name ## _TIME
+#endif
+
+/* Maximum value of http.worker_count */
+#define HTTP_MAX_WORKERS 64
+
 /* Global variables */
 static CURL * g_http_handle = NULL;
+static CURLSH * g_http_share = NULL;
+static CURLM * g_http_multi = NULL;
+
+/* Connection pool GUC variables */
+static bool http_pool_enabled = false;
+static int http_pool_max_connections = 25;
+static int http_pool_max_host_connections = 0;
+static int http_pool_idle_timeout = 118;
+static int http_pool_max_lifetime = 0;
+static int http_ca_cache_timeout = 86400;
+static int http_http_version = CURL_HTTP_VERSION_NONE;
+
+/* Values for http.http_version, as the CURLOPT_HTTP_VERSION they set */
+static const struct config_enum_entry http_version_options[] = {
+	{"default", CURL_HTTP_VERSION_NONE, false},
+	{"1.0", CURL_HTTP_VERSION_1_0, false},
+	{"1.1", CURL_HTTP_VERSION_1_1, false},
+#if LIBCURL_VERSION_NUM >= 0x072100 /* 7.33.0 */
+	{"2", CURL_HTTP_VERSION_2_0, false},
+#endif
+#if LIBCURL_VERSION_NUM >= 0x072f00 /* 7.47.0 */
+	{"2tls", CURL_HTTP_VERSION_2TLS, false},
+#endif
+#if LIBCURL_VERSION_NUM >= 0x073100 /* 7.49.0 */
+	{"2-prior-knowledge", CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE, false},
+#endif
+	{NULL, 0, false}
+};
+
+/* Response size GUC variables */
+static int http_max_response_bytes = 0;
+static int http_spill_threshold = 0;
+
+/* Connection pool counters for this backend */
+static int64 g_pool_requests = 0;
+static int64 g_pool_connections_opened = 0;
+static int64 g_pool_connections_reused = 0;
 
 #if PG_VERSION_NUM >= 170000
 static uint32 wait_event_transfer = 0;
+static uint32 wait_event_dns_lookup;
+static uint32 wait_event_connect;
+static uint32 wait_event_tls_handshake;
+static uint32 wait_event_send;
+static uint32 wait_event_first_byte;
+static uint32 wait_event_receive;
+static bool g_transfer_waiting = false;
+#endif
+static uint32 wait_event_worker = PG_WAIT_EXTENSION;
+static uint32 wait_event_rate_limit = PG_WAIT_EXTENSION;
+static uint32 wait_event_retry = PG_WAIT_EXTENSION;
+
+/* Shared memory hooks */
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+/*
+* Custom wait events need shared memory, which is not yet
+* available when we are loaded by shared_preload_libraries,
+* so they are registered on first use.
+*/
+static void
+http_wait_events_init(void)
+{
+#if PG_VERSION_NUM >= 170000
+	if (wait_event_transfer)
+		return;
+	wait_event_transfer = WaitEventExtensionNew("HttpTransfer");
+	wait_event_worker = WaitEventExtensionNew("HttpWorkerMain");
+	wait_event_rate_limit = WaitEventExtensionNew("HttpRateLimitWait");
+	wait_event_retry = WaitEventExtensionNew("HttpRetryBackoff");
+	wait_event_dns_lookup = WaitEventExtensionNew("HttpDnsLookup");
+	wait_event_connect = WaitEventExtensionNew("HttpConnect");
+	wait_event_tls_handshake = WaitEventExtensionNew("HttpTlsHandshake");
+	wait_event_send = WaitEventExtensionNew("HttpSend");
+	wait_event_first_byte = WaitEventExtensionNew("HttpWaitFirstByte");
+	wait_event_receive = WaitEventExtensionNew("HttpReceive");
+#endif
+}
+
+#if PG_VERSION_NUM >= 170000
+/*
+* Transfers start out waiting on HttpTransfer, and the progress
+* callback moves the wait on to the phase the transfer is in.
+*/
+static void
+http_transfer_wait_start(void)
+{
+	pgstat_report_wait_start(wait_event_transfer);
+	g_transfer_waiting = true;
+}
+
+static void
+http_transfer_wait_end(void)
+{
+	pgstat_report_wait_end();
+	g_transfer_waiting = false;
+}
+
+/*
+* Work out the phase of a transfer from the times curl has
+* recorded so far, each of which stays zero until reached. With
+* several transfers running at once, the last one to make
+* progress sets the wait event.
+*/
+static void
+http_transfer_wait_phase(CURL *handle, curl_off_t ultotal, curl_off_t ulnow)
+{
+	uint32 wait_event;
+
+	if (!g_transfer_waiting || !handle)
+		return;
+
+	if (http_transfer_time(handle, HTTP_TIME_INFO(PRETRANSFER)) > 0)
+	{
+		if (http_transfer_time(handle, HTTP_TIME_INFO(STARTTRANSFER)) > 0)
+			wait_event = wait_event_receive;
+		else if (ultotal > ulnow)
+			wait_event = wait_event_send;
+		else
+			wait_event = wait_event_first_byte;
+	}
+	else if (http_transfer_time(handle, HTTP_TIME_INFO(NAMELOOKUP)) == 0)
+		wait_event = wait_event_dns_lookup;
+	else if (http_transfer_time(handle, HTTP_TIME_INFO(CONNECT)) == 0)
+		wait_event = wait_event_connect;
+	else
+		wait_event = wait_event_tls_handshake;
+
+	pgstat_report_wait_start(wait_event);
+}
 #endif
 
 /*
@@ -236,11 +457,15 @@ static uint32 wait_event_transfer = 0;
 * callback frequently, and here we watch to see if PgSQL has flipped
 * the global QueryCancelPending || ProcDiePending flags.
 * Curl should then return CURLE_ABORTED_BY_CALLBACK
-* to the curl_easy_perform() call.
+* to the curl_easy_perform() call. The callback data is
+* the handle, for following the phases of the transfer.
 */
 static int
 http_progress_callback(void *clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow)
 {
+#if PG_VERSION_NUM >= 170000
+	http_transfer_wait_phase((CURL *) clientp, ultotal, ulnow);
+#endif
 #ifdef WIN32
 	if (UNBLOCKED_SIGNAL_QUEUE())
 		pgwin32_dispatch_queued_signals();
@@ -346,12 +571,6 @@ guc_strdup(int elevel, const char *src)
 	memcpy(dup, src, len);
 	return dup;
 }
-
-static void
-guc_free(void *ptr)
-{
-	free(ptr);
-}
 #endif
 
 
@@ -439,10 +658,37 @@ void _PG_init(void)
 	 * to manipulate CURL options.
 	 */
 	http_guc_init();
+	http_pool_guc_init();
 
-#if PG_VERSION_NUM >= 170000
-	wait_event_transfer = WaitEventExtensionNew("HttpTransfer");
+	/* Forget cached type oids when the types change */
+	CacheRegisterSyscacheCallback(TYPEOID, http_type_cache_invalidate, (Datum) 0);
+
+	http_dns_guc_init();
+	http_cache_guc_init();
+	http_rate_guc_init();
+	http_circuit_guc_init();
+	http_retry_guc_init();
+	http_stats_guc_init();
+	http_response_guc_init();
+	http_worker_guc_init();
+
+	/*
+	 * Shared memory and background workers are only
+	 * available when loaded by shared_preload_libraries.
+	 */
+	if (process_shared_preload_libraries_in_progress)
+	{
+#if PG_VERSION_NUM >= 150000
+		prev_shmem_request_hook = shmem_request_hook;
+		shmem_request_hook = http_shmem_request;
+#else
+		http_shmem_request();
 #endif
+		prev_shmem_startup_hook = shmem_startup_hook;
+		shmem_startup_hook = http_shmem_startup;
+
+		http_worker_register();
+	}
 
 #ifdef HTTP_MEM_CALLBACKS
 	/*
@@ -473,38 +719,224 @@ void _PG_fini(void)
 		g_http_handle = NULL;
 	}
 
+	if (g_http_multi)
+	{
+		curl_multi_cleanup(g_http_multi);
+		g_http_multi = NULL;
+	}
+
+	if (g_http_share)
+	{
+		curl_share_cleanup(g_http_share);
+		g_http_share = NULL;
+	}
+
 	curl_global_cleanup();
 	elog(NOTICE, "Goodbye from HTTP %s", HTTP_VERSION);
 }
 
+/*
+* Empty the body buffer down to its bytea header room, if any,
+* giving back the memory it had grown to.
+*/
+static void
+http_transfer_body_shrink(http_transfer *xfer)
+{
+	StringInfo si = &(xfer->si_data);
+	MemoryContext oldcontext = MemoryContextSwitchTo(GetMemoryChunkContext(si->data));
+
+	pfree(si->data);
+	initStringInfo(si);
+	if (xfer->binary)
+		appendStringInfoSpaces(si, VARHDRSZ);
+	MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+* Spill files are made in a subtransaction around the curl
+* calls, as the large object transfers are, so that an error
+* in the write callback can be rolled back there rather than
+* thrown through curl. Without a spill threshold there is no
+* need for one, and in parallel workers, which cannot start
+* subtransactions, bodies stay in memory.
+*/
+static void
+http_spill_begin(http_spill_scope *scope)
+{
+	memset(scope, 0, sizeof(http_spill_scope));
+	if (http_spill_threshold <= 0 || IsInParallelMode())
+		return;
+	scope->mcxt = CurrentMemoryContext;
+	scope->owner = CurrentResourceOwner;
+	BeginInternalSubTransaction(NULL);
+	MemoryContextSwitchTo(scope->mcxt);
+	scope->active = true;
+}
+
+static void
+http_spill_rollback(http_spill_scope *scope)
+{
+	RollbackAndReleaseCurrentSubTransaction();
+	MemoryContextSwitchTo(scope->mcxt);
+	CurrentResourceOwner = scope->owner;
+	scope->active = false;
+	scope->lost = true;
+}
+
+static void
+http_spill_catch(http_spill_scope *scope)
+{
+	MemoryContextSwitchTo(scope->mcxt);
+	scope->error = CopyErrorData();
+	FlushErrorState();
+	http_spill_rollback(scope);
+}
+
+static void
+http_spill_end(http_spill_scope *scope)
+{
+	/* After an error the subtransaction is already gone */
+	if (!scope->active)
+		return;
+	ReleaseCurrentSubTransaction();
+	MemoryContextSwitchTo(scope->mcxt);
+	CurrentResourceOwner = scope->owner;
+	scope->active = false;
+}
+
+/* For errors raised outside curl while the subtransaction is open */
+static void
+http_spill_abort(http_spill_scope *scope)
+{
+	if (scope->active)
+		http_spill_rollback(scope);
+}
+
+/*
+* Write to the spill file, starting it if need be. On error
+* the spill subtransaction is rolled back, and the write is
+* reported as failed.
+*/
+static bool
+http_transfer_spill(http_transfer *xfer, void *data, size_t len)
+{
+	http_spill_scope *scope = xfer->spill_scope;
+
+	PG_TRY();
+	{
+		if (!xfer->spill)
+			xfer->spill = BufFileCreateTemp(false);
+		BufFileWrite(xfer->spill, data, len);
+	}
+	PG_CATCH();
+	{
+		http_spill_catch(scope);
+	}
+	PG_END_TRY();
+
+	return scope->error == NULL;
+}
+
 /**
 * This function is passed into CURL as the CURLOPT_WRITEFUNCTION,
 * this allows the  return values to be held in memory, in our case in a string.
+* The transfer is our userp. Past http.spill_threshold the body goes to a
+* temporary file instead, and past http.max_response_bytes the transfer
+* is stopped by taking none of the data. Transfers run outside a
+* spill subtransaction, as those of the background worker are, keep
+* the body in memory.
 */
 static size_t
 http_writeback(void *contents, size_t size, size_t nmemb, void *userp)
 {
 	size_t realsize = size * nmemb;
-	StringInfo si = (StringInfo)userp;
+	http_transfer *xfer = (http_transfer *)userp;
+	StringInfo si = &(xfer->si_data);
+
+	if ( http_max_response_bytes > 0 && xfer->received + realsize > (size_t) http_max_response_bytes )
+	{
+		xfer->too_large = true;
+		return 0;
+	}
+	xfer->received += realsize;
+
+	/* Once a spill has failed, the transfers with it stop too */
+	if ( xfer->spill_scope && xfer->spill_scope->error )
+		return 0;
+
+	if ( xfer->spill )
+		return http_transfer_spill(xfer, contents, realsize) ? realsize : 0;
+
 	appendBinaryStringInfo(si, (const char*)contents, (int)realsize);
+
+	if ( http_spill_threshold > 0 && xfer->spill_scope && xfer->spill_scope->active &&
+	     xfer->received > (size_t) http_spill_threshold * 1024 )
+	{
+		int offset = xfer->binary ? VARHDRSZ : 0;
+		if ( !http_transfer_spill(xfer, si->data + offset, si->len - offset) )
+			return 0;
+		http_transfer_body_shrink(xfer);
+	}
 	return realsize;
 }
 
+/*
+* Bring a spilled body back into the body buffer, allocated at
+* its exact size, now that the whole of it is known.
+*/
+static void
+http_transfer_body_unspill(http_transfer *xfer)
+{
+	StringInfo si = &(xfer->si_data);
+	int offset = xfer->binary ? VARHDRSZ : 0;
+	BufFile *file = xfer->spill;
+	char *data;
+
+	xfer->spill = NULL;
+	if ( xfer->received > MaxAllocSize - offset - 1 )
+	{
+		BufFileClose(file);
+		ereport(ERROR,
+		        (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+		         errmsg("response from \"%s\" is too large", xfer->uri)));
+	}
+
+	data = MemoryContextAlloc(GetMemoryChunkContext(si->data), offset + xfer->received + 1);
+	memcpy(data, si->data, offset);
+	if ( BufFileSeek(file, 0, 0L, SEEK_SET) != 0 )
+		ereport(ERROR, (errcode_for_file_access(), errmsg("could not rewind response spill file")));
+#if PG_VERSION_NUM >= 160000
+	BufFileReadExact(file, data + offset, xfer->received);
+#else
+	if ( BufFileRead(file, data + offset, xfer->received) != xfer->received )
+		ereport(ERROR, (errcode_for_file_access(), errmsg("could not read response spill file")));
+#endif
+	BufFileClose(file);
+
+	pfree(si->data);
+	si->data = data;
+	si->len = offset + xfer->received;
+	si->maxlen = si->len + 1;
+	si->data[si->len] = '\0';
+}
+
 /**
 * This function is passed into CURL as the CURLOPT_READFUNCTION,
 * this allows the PUT operation to read the data it needs. We
-* pass a StringInfo as our input, and per the callback contract
-* return the number of bytes read at each call.
+* pass the transfer as our input, and read from the request
+* content it points at, so the body is never copied before
+* curl asks for it. Per the callback contract we return the
+* number of bytes read at each call.
 */
 static size_t
 http_readback(void *buffer, size_t size, size_t nitems, void *instream)
 {
 	size_t reqsize = size * nitems;
-	StringInfo si = (StringInfo)instream;
-	size_t remaining = si->len - si->cursor;
+	http_transfer *xfer = (http_transfer *)instream;
+	size_t remaining = xfer->body_len - xfer->body_pos;
 	size_t readsize = Min(reqsize, remaining);
-	memcpy(buffer, si->data + si->cursor, readsize);
-	si->cursor += readsize;
+	memcpy(buffer, xfer->body + xfer->body_pos, readsize);
+	xfer->body_pos += readsize;
 	return readsize;
 }
 
@@ -518,13 +950,11 @@ http_error(CURLcode err, const char *error_buffer)
 }
 
 /* Utility macro to try a setopt and catch an error */
+/* http_error() always raises an ERROR, so it does not return */
 #define CURL_SETOPT(handle, opt, value) do { \
 	err = curl_easy_setopt((handle), (opt), (value)); \
 	if ( err != CURLE_OK ) \
-	{ \
 		http_error(err, http_error_buffer); \
-		PG_RETURN_NULL(); \
-	} \
 	} while (0);
 
 
@@ -554,7 +984,7 @@ request_type(const char *method)
 * Given a field name and value, output a http_header tuple.
 */
 static Datum
-header_tuple(TupleDesc header_tuple_desc, const char *field, const char *value)
+header_tuple(TupleDesc header_tuple_desc, const char *field, int field_len, const char *value, int value_len)
 {
 	HeapTuple header_tuple;
 	int ncolumns;
@@ -566,9 +996,9 @@ header_tuple(TupleDesc header_tuple_desc, const char *field, const char *value)
 	header_values = palloc0(sizeof(Datum)*ncolumns);
 	header_nulls = palloc0(sizeof(bool)*ncolumns);
 
-	header_values[HEADER_FIELD] = CStringGetTextDatum(field);
+	header_values[HEADER_FIELD] = PointerGetDatum(cstring_to_text_with_len(field, field_len));
 	header_nulls[HEADER_FIELD] = false;
-	header_values[HEADER_VALUE] = CStringGetTextDatum(value);
+	header_values[HEADER_VALUE] = PointerGetDatum(cstring_to_text_with_len(value, value_len));
 	header_nulls[HEADER_VALUE] = false;
 
 	/* Build up a tuple from values/nulls lists */
@@ -604,25 +1034,6 @@ http_strcasestr(const char *s, const char *find)
 	return ((char *)s);
 }
 
-/**
-* Quick and dirty, remove all \r from a StringInfo.
-*/
-static void
-string_info_remove_cr(StringInfo si)
-{
-	int i = 0, j = 0;
-	while ( si->data[i] )
-	{
-		if ( si->data[i] != '\r' )
-			si->data[j++] = si->data[i++];
-		else
-			i++;
-	}
-	si->data[j] = '\0';
-	si->len -= i-j;
-	return;
-}
-
 /**
 * Add an array of http_header tuples into a Curl string list.
 */
@@ -632,12 +1043,11 @@ header_array_to_slist(ArrayType *array, struct curl_slist *headers)
 	ArrayIterator iterator;
 	Datum value;
 	bool isnull;
+	TupleDesc tup_desc = NULL;
+	Oid desc_type = InvalidOid;
+	int32 desc_typmod = -1;
 
-#if PG_VERSION_NUM >= 90500
 	iterator = array_create_iterator(array, 0, NULL);
-#else
-	iterator = array_create_iterator(array, 0);
-#endif
 
 	while (array_iterate(iterator, &value, &isnull))
 	{
@@ -645,7 +1055,6 @@ header_array_to_slist(ArrayType *array, struct curl_slist *headers)
 		HeapTupleData tuple;
 		Oid tup_type;
 		int32 tup_typmod, ncolumns;
-		TupleDesc tup_desc;
 		size_t tup_len;
 		Datum *values;
 		bool *nulls;
@@ -658,7 +1067,16 @@ header_array_to_slist(ArrayType *array, struct curl_slist *headers)
 		tup_type = HeapTupleHeaderGetTypeId(rec);
 		tup_typmod = HeapTupleHeaderGetTypMod(rec);
 		tup_len = HeapTupleHeaderGetDatumLength(rec);
-		tup_desc = lookup_rowtype_tupdesc(tup_type, tup_typmod);
+
+		/* The elements all share a type, so look it up just once */
+		if ( ! tup_desc || tup_type != desc_type || tup_typmod != desc_typmod )
+		{
+			if ( tup_desc )
+				ReleaseTupleDesc(tup_desc);
+			tup_desc = lookup_rowtype_tupdesc(tup_type, tup_typmod);
+			desc_type = tup_type;
+			desc_typmod = tup_typmod;
+		}
 		ncolumns = tup_desc->natts;
 
 		/* Prepare for values / nulls to hold the data */
@@ -713,11 +1131,12 @@ header_array_to_slist(ArrayType *array, struct curl_slist *headers)
 		}
 
 		/* Free all the temporary structures */
-		ReleaseTupleDesc(tup_desc);
 		pfree(values);
 		pfree(nulls);
 	}
 	array_free_iterator(iterator);
+	if ( tup_desc )
+		ReleaseTupleDesc(tup_desc);
 
 	return headers;
 }
@@ -736,11 +1155,7 @@ get_extension_schema(Oid ext_oid)
 	SysScanDesc scandesc;
 	HeapTuple	tuple;
 	ScanKeyData entry[1];
-#if PG_VERSION_NUM >= 120000
 	Oid pg_extension_oid = Anum_pg_extension_oid;
-#else
-	Oid pg_extension_oid = ObjectIdAttributeNumber;
-#endif
 	Relation rel = table_open(ExtensionRelationId, AccessShareLock);
 
 	ScanKeyInit(&entry[0],
@@ -767,61 +1182,146 @@ get_extension_schema(Oid ext_oid)
 }
 #endif
 
+/*
+* The oids of our types, looked up once per backend, and
+* forgotten whenever a type changes, such as when the
+* extension is dropped, moved or updated.
+*/
+typedef struct {
+	const char *typname;
+	Oid typoid;
+} http_type_cache_entry;
+
+static http_type_cache_entry g_type_cache[] = {
+	{"http_header", InvalidOid},
+	{"http_response", InvalidOid},
+	{NULL, InvalidOid}
+};
+
+static void
+http_type_cache_invalidate(Datum arg, int cacheid, uint32 hashvalue)
+{
+	http_type_cache_entry *entry;
+	for (entry = g_type_cache; entry->typname; entry++)
+		entry->typoid = InvalidOid;
+}
+
 /**
-* Look up the tuple description for a extension-defined type,
-* avoiding the pitfalls of using relations that are not part
-* of the extension, but share the same name as the relation
-* of interest.
+* Look up the oid of a type belonging to the extension.
 */
-static TupleDesc
-typname_get_tupledesc(const char *extname, const char *typname)
+static Oid
+typname_get_typoid(const char *extname, const char *typname)
 {
-	Oid extoid = get_extension_oid(extname, true);
+	http_type_cache_entry *entry;
+	Oid extoid;
 	Oid extschemaoid;
 	Oid typoid;
 
+	for (entry = g_type_cache; entry->typname; entry++)
+	{
+		if ( strcmp(entry->typname, typname) == 0 )
+		{
+			if ( OidIsValid(entry->typoid) )
+				return entry->typoid;
+			break;
+		}
+	}
+
+	extoid = get_extension_oid(extname, true);
 	if ( ! OidIsValid(extoid) )
 		elog(ERROR, "could not lookup '%s' extension oid", extname);
 
 	extschemaoid = get_extension_schema(extoid);
 
-#if PG_VERSION_NUM >= 120000
 	typoid = GetSysCacheOid2(TYPENAMENSP, Anum_pg_type_oid,
 	            PointerGetDatum(typname),
 	            ObjectIdGetDatum(extschemaoid));
-#else
-	typoid = GetSysCacheOid2(TYPENAMENSP,
-	            PointerGetDatum(typname),
-	            ObjectIdGetDatum(extschemaoid));
-#endif
 
-	if ( OidIsValid(typoid) )
+	if ( ! OidIsValid(typoid) || getExtensionOfObject(TypeRelationId, typoid) != extoid )
+		elog(ERROR, "could not lookup '%s' tuple desc", typname);
+
+	if ( entry->typname )
+		entry->typoid = typoid;
+	return typoid;
+}
+
+/**
+* The result type of a function returning a composite, kept
+* with the function call so it is only looked up on the
+* first of many rows.
+*/
+static TupleDesc
+http_call_result_tupdesc(FunctionCallInfo fcinfo)
+{
+	TupleDesc tup_desc = (TupleDesc) fcinfo->flinfo->fn_extra;
+
+	if ( ! tup_desc )
 	{
-		// Oid typ_oid = get_typ_typrelid(rel_oid);
-		Oid relextoid = getExtensionOfObject(TypeRelationId, typoid);
-		if ( relextoid == extoid )
-		{
-			return TypeGetTupleDesc(typoid, NIL);
-		}
+		MemoryContext oldcontext;
+
+		if (get_call_result_type(fcinfo, 0, &tup_desc) != TYPEFUNC_COMPOSITE)
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("%s called with incompatible return type", __func__)));
+
+		oldcontext = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+		tup_desc = CreateTupleDescCopy(tup_desc);
+		MemoryContextSwitchTo(oldcontext);
+		fcinfo->flinfo->fn_extra = tup_desc;
 	}
+	return tup_desc;
+}
 
-	elog(ERROR, "could not lookup '%s' tuple desc", typname);
+/**
+* Look up the tuple descriptor of a composite type belonging
+* to the extension. The descriptor comes from the type cache,
+* and must be released with ReleaseTupleDesc().
+*/
+static TupleDesc
+typname_get_tupledesc(const char *extname, const char *typname)
+{
+	return lookup_rowtype_tupdesc(typname_get_typoid(extname, typname), -1);
 }
 
 
-#define RVSZ 8192 /* Max length of header element */
+#define HTTP_IS_WS(c) ((c) == ' ' || (c) == '\t')
+
+/*
+* Add one parsed header to the array being built.
+*/
+static void
+header_array_append(Datum **elems, size_t *nelems, size_t *size, TupleDesc desc,
+                    const char *field, int field_len, const char *value, int value_len)
+{
+	/* Trailing whitespace is not part of the value */
+	while ( value_len > 0 && HTTP_IS_WS(value[value_len-1]) )
+		value_len--;
+
+	/* Increase elements array size if necessary */
+	if ( *nelems >= *size )
+	{
+		*size *= 2;
+		*elems = repalloc(*elems, *size * sizeof(Datum));
+	}
+	(*elems)[(*nelems)++] = header_tuple(desc, field, field_len, value, value_len);
+}
 
 /**
-* Convert a string of headers separated by newlines/CRs into an
-* array of http_header tuples.
+* Convert the raw headers curl received into an array of
+* http_header tuples, in a single pass over the string.
+* Lines may end in CRLF or LF, values may be empty, and
+* obsolete folded continuation lines are joined to the value
+* they continue. Each response (from a redirect, or a 100
+* Continue) starts a new block of headers with its status
+* line, and only the headers of the final block are kept.
 */
 static ArrayType *
 header_string_to_array(StringInfo si)
 {
 	/* Array building */
 	size_t arr_nelems = 0;
-	size_t arr_elems_size = 8;
-	Datum *arr_elems = palloc0(arr_elems_size*sizeof(Datum));
+	size_t arr_elems_size = 16;
+	Datum *arr_elems = palloc(arr_elems_size*sizeof(Datum));
 	Oid elem_type;
 	int16 elem_len;
 	bool elem_byval;
@@ -829,19 +1329,13 @@ header_string_to_array(StringInfo si)
 
 	/* Header handling */
 	TupleDesc header_tuple_desc = NULL;
-
-	/* Regex support */
-	const char *regex_pattern = "^([^ \t\r\n\v\f]+): ?([^ \t\r\n\v\f]+.*)$";
-	regex_t regex;
-	regmatch_t pmatch[3];
-	int reti;
-	char rv1[RVSZ];
-	char rv2[RVSZ];
-
-	/* Compile the regular expression */
-	reti = regcomp(&regex, regex_pattern, REG_ICASE | REG_EXTENDED | REG_NEWLINE );
-	if ( reti )
-		elog(ERROR, "Unable to compile regex pattern '%s'", regex_pattern);
+	const char *p = si->data;
+	const char *end = si->data + si->len;
+	const char *field = NULL;
+	int field_len = 0;
+	const char *value = NULL;
+	int value_len = 0;
+	StringInfoData folded;
 
 	/* Lookup the tuple defn */
 	header_tuple_desc = typname_get_tupledesc("http", "http_header");
@@ -850,43 +1344,109 @@ header_string_to_array(StringInfo si)
 	elem_type = header_tuple_desc->tdtypeid;
 	get_typlenbyvalalign(elem_type, &elem_len, &elem_byval, &elem_align);
 
-	/* Loop through string, matching regex pattern */
-	si->cursor = 0;
-	while ( ! regexec(&regex, si->data+si->cursor, 3, pmatch, 0) )
+	folded.data = NULL;
+	while ( p < end )
 	{
-		/* Read the regex match results */
-		int eo0 = pmatch[0].rm_eo;
-		int so1 = pmatch[1].rm_so;
-		int eo1 = pmatch[1].rm_eo;
-		int so2 = pmatch[2].rm_so;
-		int eo2 = pmatch[2].rm_eo;
+		const char *eol = memchr(p, '\n', end - p);
+		const char *line = p;
+		const char *colon;
+		int len;
+
+		if ( ! eol )
+			eol = end;
+		p = eol + 1;
+		len = eol - line;
+		if ( len > 0 && line[len-1] == '\r' )
+			len--;
+
+		/* A folded line continues the value of the header before it */
+		if ( len > 0 && HTTP_IS_WS(line[0]) )
+		{
+			if ( ! field )
+				continue;
+			while ( len > 0 && HTTP_IS_WS(line[0]) )
+			{
+				line++;
+				len--;
+			}
+			if ( ! folded.data )
+				initStringInfo(&folded);
+			if ( value != folded.data )
+			{
+				resetStringInfo(&folded);
+				appendBinaryStringInfo(&folded, value, value_len);
+			}
+			appendStringInfoChar(&folded, ' ');
+			appendBinaryStringInfo(&folded, line, len);
+			value = folded.data;
+			value_len = folded.len;
+			continue;
+		}
+
+		/* Anything else completes the header before it */
+		if ( field )
+			header_array_append(&arr_elems, &arr_nelems, &arr_elems_size, header_tuple_desc,
+			                    field, field_len, value, value_len);
+		field = NULL;
 
-		/* Copy the matched portions out of the string */
-		int len1 = Min(eo1-so1, RVSZ-1);
-		int len2 = Min(eo2-so2, RVSZ-1);
-		memcpy(rv1, si->data+si->cursor+so1, len1);
-		memcpy(rv2, si->data+si->cursor+so2, len2);
-		rv1[len1] = '\0';
-		rv2[len2] = '\0';
+		/* A status line starts a new response, forget the last one */
+		if ( len >= 5 && strncmp(line, "HTTP/", 5) == 0 )
+		{
+			arr_nelems = 0;
+			continue;
+		}
 
-		/* Move forward for next match */
-		si->cursor += eo0;
+		/* A field name is a token, with no whitespace, before a colon */
+		colon = memchr(line, ':', len);
+		if ( ! colon || colon == line )
+			continue;
+		field = line;
+		field_len = colon - line;
+		if ( memchr(field, ' ', field_len) || memchr(field, '\t', field_len) )
+		{
+			field = NULL;
+			continue;
+		}
 
-		/* Increase elements array size if necessary */
-		if ( arr_nelems >= arr_elems_size )
+		/* The value is what follows, less leading whitespace */
+		value = colon + 1;
+		value_len = len - field_len - 1;
+		while ( value_len > 0 && HTTP_IS_WS(value[0]) )
 		{
-			arr_elems_size *= 2;
-			arr_elems = repalloc(arr_elems, arr_elems_size*sizeof(Datum));
+			value++;
+			value_len--;
 		}
-		arr_elems[arr_nelems] = header_tuple(header_tuple_desc, rv1, rv2);
-		arr_nelems++;
 	}
 
-	regfree(&regex);
+	if ( field )
+		header_array_append(&arr_elems, &arr_nelems, &arr_elems_size, header_tuple_desc,
+		                    field, field_len, value, value_len);
+
+	if ( folded.data )
+		pfree(folded.data);
 	ReleaseTupleDesc(header_tuple_desc);
 	return construct_array(arr_elems, arr_nelems, elem_type, elem_len, elem_byval, elem_align);
 }
 
+/**
+* Parse a raw block of response headers, as received, into
+* an array of http_header, the way the headers of a response
+* are parsed.
+*/
+Datum http_parse_headers(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(http_parse_headers);
+Datum http_parse_headers(PG_FUNCTION_ARGS)
+{
+	text *raw = PG_GETARG_TEXT_PP(0);
+	StringInfoData si;
+
+	si.data = VARDATA_ANY(raw);
+	si.len = VARSIZE_ANY_EXHDR(raw);
+	si.maxlen = si.len + 1;
+	si.cursor = 0;
+	PG_RETURN_ARRAYTYPE_P(header_string_to_array(&si));
+}
+
 /* Check/log version info */
 static void
 http_check_curl_version(const curl_version_info_data *version_info)
@@ -915,7 +1475,33 @@ curlopt_is_set(CURLoption curlopt)
 	return false;
 }
 
-
+/*
+* Whether any of a zero-terminated list of options has been
+* changed in this session, with http_set_curlopt() or SET,
+* from the value configured for the server, database or role.
+*/
+static bool
+curlopts_are_changed(const CURLoption *curlopts)
+{
+	for (; *curlopts; curlopts++)
+	{
+		http_curlopt *opt = settable_curlopts;
+		while (opt->curlopt)
+		{
+			if (opt->curlopt == *curlopts)
+			{
+				const char *reset = GetConfigOptionResetString(opt->curlopt_guc);
+				if (strcmp(opt->curlopt_val ? opt->curlopt_val : "", reset ? reset : "") != 0)
+					return true;
+				break;
+			}
+			opt++;
+		}
+	}
+	return false;
+}
+
+
 static bool
 set_curlopt(CURL* handle, const http_curlopt *opt)
 {
@@ -972,30 +1558,678 @@ set_curlopt(CURL* handle, const http_curlopt *opt)
 	return true;
 }
 
-/* Check/create the global CURL* handle */
-static CURL *
-http_get_handle(void)
+/*
+* Connections are kept open for reuse when the pool is
+* enabled, or for backwards compatibility, when
+* CURLOPT_TCP_KEEPALIVE is set.
+*/
+static bool
+http_pool_active(void)
 {
-	CURL *handle = g_http_handle;
-	http_curlopt *opt = settable_curlopts;
+	return http_pool_enabled || curlopt_is_set(CURLOPT_TCP_KEEPALIVE);
+}
 
-	/* Initialize the global handle if needed */
-	if (!handle)
+/*
+* The per-backend share holds the connection cache, the
+* DNS cache and the TLS session cache, so they outlive
+* any one easy handle.
+*/
+static CURLSH *
+http_get_share(void)
+{
+	if (g_http_share)
+		return g_http_share;
+
+	g_http_share = curl_share_init();
+	if (!g_http_share)
+		ereport(ERROR, (errmsg("Unable to initialize CURL share")));
+
+	curl_share_setopt(g_http_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(g_http_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900 /* 7.57.0 */
+	curl_share_setopt(g_http_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+	return g_http_share;
+}
+
+/*
+* Apply the pool limits to a multi handle, which is where
+* curl enforces the per-host connection limit.
+*/
+static void
+http_pool_multi_init(CURLM *multi)
+{
+#if LIBCURL_VERSION_NUM >= 0x071e00 /* 7.30.0 */
+	curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)http_pool_max_host_connections);
+	curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, (long)http_pool_max_connections);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x072b00 /* 7.43.0 */
+	/* Run concurrent HTTP/2 transfers to one host as streams of one connection */
+	curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+#endif
+}
+
+/*
+* Check/create the global CURLM* handle, which is kept for
+* the life of the backend along with the caches it holds.
+*/
+static CURLM *
+http_get_multi(void)
+{
+	if (!g_http_multi)
 	{
-		handle = curl_easy_init();
-		if (!handle)
-			ereport(ERROR, (errmsg("Unable to initialize CURL")));
+		g_http_multi = curl_multi_init();
+		if (!g_http_multi)
+			ereport(ERROR, (errmsg("Unable to initialize CURL multi handle")));
 	}
+	http_pool_multi_init(g_http_multi);
+	return g_http_multi;
+}
 
-	/* Always reset so GUC-supplied options (e.g. tiny timeouts) are
-	 * reliably enforced on both new and reused handles. */
-	curl_easy_reset(handle);
+/*
+* Count the connections a completed transfer opened, to
+* see how well the pool is doing.
+*/
+static void
+http_pool_note_transfer(CURL *handle)
+{
+	long num_connects = 0;
+
+	g_pool_requests++;
+	if (curl_easy_getinfo(handle, CURLINFO_NUM_CONNECTS, &num_connects) != CURLE_OK)
+		return;
+
+	if (num_connects > 0)
+		g_pool_connections_opened += num_connects;
+	else
+		g_pool_connections_reused++;
+}
+
+/**
+* Report the connection pool counters for this backend.
+*/
+Datum http_pool_stats(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(http_pool_stats);
+Datum http_pool_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc tup_desc;
+	Datum values[4];
+	bool nulls[4] = {false, false, false, false};
+
+	if (get_call_result_type(fcinfo, NULL, &tup_desc) != TYPEFUNC_COMPOSITE)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("%s called with incompatible return type", __func__)));
+
+	values[0] = BoolGetDatum(http_pool_active());
+	values[1] = Int64GetDatum(g_pool_requests);
+	values[2] = Int64GetDatum(g_pool_connections_opened);
+	values[3] = Int64GetDatum(g_pool_connections_reused);
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tup_desc), values, nulls)));
+}
+
+/*
+* HTTP/2 needs a libcurl built with it, which is better found
+* out when the setting is made than on the first request.
+*/
+static bool
+http_version_check(int *newval, void **extra, GucSource source)
+{
+#if LIBCURL_VERSION_NUM >= 0x072100 /* 7.33.0 */
+	if (*newval != CURL_HTTP_VERSION_NONE &&
+	    *newval != CURL_HTTP_VERSION_1_0 && *newval != CURL_HTTP_VERSION_1_1 &&
+	    !(curl_version_info(CURLVERSION_NOW)->features & CURL_VERSION_HTTP2))
+	{
+		GUC_check_errdetail("libcurl was built without HTTP/2 support.");
+		return false;
+	}
+#endif
+	return true;
+}
+
+static void
+http_pool_guc_init(void)
+{
+	DefineCustomBoolVariable(
+		"http.pool_enabled",
+		"Keep connections open for reuse by later requests.",
+		NULL,
+		&http_pool_enabled,
+		false,
+		PGC_USERSET,
+		0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable(
+		"http.pool_max_connections",
+		"Maximum number of idle connections kept open.",
+		NULL,
+		&http_pool_max_connections,
+		25, 1, 10000,
+		PGC_USERSET,
+		0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable(
+		"http.pool_max_host_connections",
+		"Maximum number of connections to a single host in concurrent requests.",
+		"Zero means no limit.",
+		&http_pool_max_host_connections,
+		0, 0, 10000,
+		PGC_USERSET,
+		0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable(
+		"http.pool_idle_timeout",
+		"Time an idle connection is kept before it is closed.",
+		NULL,
+		&http_pool_idle_timeout,
+		118, 1, INT_MAX,
+		PGC_USERSET,
+		GUC_UNIT_S, NULL, NULL, NULL);
+
+	DefineCustomIntVariable(
+		"http.pool_max_lifetime",
+		"Time after which a connection is no longer reused.",
+		"Zero means no limit.",
+		&http_pool_max_lifetime,
+		0, 0, INT_MAX,
+		PGC_USERSET,
+		GUC_UNIT_S, NULL, NULL, NULL);
+
+	DefineCustomEnumVariable(
+		"http.http_version",
+		"HTTP version to use for requests.",
+		"The default lets curl choose, usually HTTP/2 over TLS where the server offers it.",
+		&http_http_version,
+		CURL_HTTP_VERSION_NONE,
+		http_version_options,
+		PGC_USERSET,
+		0, http_version_check, NULL, NULL);
+
+	DefineCustomIntVariable(
+		"http.ca_cache_timeout",
+		"Time the parsed CA certificate store is kept for reuse.",
+		"Zero disables the cache, -1 keeps it forever.",
+		&http_ca_cache_timeout,
+		86400, -1, INT_MAX,
+		PGC_USERSET,
+		GUC_UNIT_S, NULL, NULL, NULL);
+}
+
+/*************************************************************************
+* Shared DNS cache
+*
+* When loaded by shared_preload_libraries, host name lookups
+* are cached in shared memory for all backends. A cached
+* address is handed to curl with CURLOPT_RESOLVE, so the
+* transfer skips the resolver entirely. Failed lookups are
+* cached too, for a shorter time, so a resolver brownout
+* fails requests quickly rather than stalling every one.
+*************************************************************************/
+
+#define HTTP_DNS_HOST_LEN 256
+#define HTTP_DNS_ADDR_LEN 64
+
+typedef struct {
+	char host[HTTP_DNS_HOST_LEN];
+	int32 port;
+} http_dns_key;
+
+typedef struct {
+	http_dns_key key;
+	char address[HTTP_DNS_ADDR_LEN]; /* empty for a failed lookup */
+	TimestampTz expires;
+	pg_atomic_uint64 hits;
+} http_dns_entry;
+
+/* DNS cache GUC variables */
+static int http_dns_cache_size = 1024;
+static int http_dns_cache_ttl = 60;
+static int http_dns_cache_negative_ttl = 5;
+
+/* DNS cache in shared memory */
+static HTAB *g_dns_cache = NULL;
+static LWLock *g_dns_lock = NULL;
+
+static Size
+http_dns_shmem_size(void)
+{
+	if (http_dns_cache_size <= 0)
+		return 0;
+	return hash_estimate_size(http_dns_cache_size, sizeof(http_dns_entry));
+}
+
+static void
+http_dns_shmem_request(void)
+{
+	if (http_dns_cache_size > 0)
+		RequestNamedLWLockTranche("pgsql-http dns", 1);
+}
+
+static void
+http_dns_shmem_startup(void)
+{
+	HASHCTL info;
+
+	if (http_dns_cache_size <= 0)
+		return;
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(http_dns_key);
+	info.entrysize = sizeof(http_dns_entry);
+	g_dns_cache = ShmemInitHash("pgsql-http dns cache",
+	                            http_dns_cache_size, http_dns_cache_size,
+	                            &info, HASH_ELEM | HASH_BLOBS);
+	g_dns_lock = &(GetNamedLWLockTranche("pgsql-http dns")->lock);
+}
+
+/* Options that change where a host name leads */
+static const CURLoption http_dns_route_curlopts[] = {
+	CURLOPT_IPRESOLVE,
+#if LIBCURL_VERSION_NUM >= 0x070e01 /* 7.14.1 */
+	CURLOPT_PROXY,
+	CURLOPT_PROXYPORT,
+#endif
+#if LIBCURL_VERSION_NUM >= 0x071800 /* 7.24.0 */
+	CURLOPT_DNS_SERVERS,
+#endif
+#if LIBCURL_VERSION_NUM >= 0x073400 /* 7.52.0 */
+	CURLOPT_PRE_PROXY,
+#endif
+	0
+};
+
+/*
+* Addresses learned through a proxy belong to the proxy,
+* so the cache stays out of the way when one is in use.
+* Nor is it used by a session that resolves or routes
+* differently from the configured way, which would
+* otherwise decide the addresses of every session.
+*/
+static bool
+http_dns_cache_usable(void)
+{
+	if (!g_dns_cache || http_dns_cache_ttl <= 0)
+		return false;
+	if (curlopt_is_set(CURLOPT_PROXY))
+		return false;
+#if LIBCURL_VERSION_NUM >= 0x073400 /* 7.52.0 */
+	if (curlopt_is_set(CURLOPT_PRE_PROXY))
+		return false;
+#endif
+	if (curlopts_are_changed(http_dns_route_curlopts))
+		return false;
+	if (getenv("http_proxy") || getenv("https_proxy") || getenv("HTTPS_PROXY") ||
+	    getenv("all_proxy") || getenv("ALL_PROXY"))
+		return false;
+	return true;
+}
+
+/* The host of a URI, in lower case, or NULL */
+static char *
+http_uri_host(const char *uri)
+{
+#if LIBCURL_VERSION_NUM >= 0x073e00 /* 7.62.0 */
+	CURLU *url = curl_url();
+	char *host = NULL;
+	char *lower = NULL;
+
+	if (url &&
+	    curl_url_set(url, CURLUPART_URL, uri, CURLU_GUESS_SCHEME) == CURLUE_OK &&
+	    curl_url_get(url, CURLUPART_HOST, &host, 0) == CURLUE_OK)
+		lower = http_strtolower(host);
+
+	curl_free(host);
+	curl_url_cleanup(url);
+	return lower;
+#else
+	return NULL;
+#endif
+}
+
+/*
+* Fill in the cache key for the host and port of a URI.
+* IP literals need no lookup, so they have no key.
+*/
+static bool
+http_dns_key_from_uri(const char *uri, http_dns_key *key)
+{
+#if LIBCURL_VERSION_NUM >= 0x073e00 /* 7.62.0 */
+	CURLU *url = curl_url();
+	char *host = NULL;
+	char *port = NULL;
+	bool ok = false;
+
+	memset(key, 0, sizeof(http_dns_key));
+	if (url &&
+	    curl_url_set(url, CURLUPART_URL, uri, CURLU_GUESS_SCHEME) == CURLUE_OK &&
+	    curl_url_get(url, CURLUPART_HOST, &host, 0) == CURLUE_OK &&
+	    curl_url_get(url, CURLUPART_PORT, &port, CURLU_DEFAULT_PORT) == CURLUE_OK &&
+	    host[0] != '[' && strspn(host, "0123456789.") != strlen(host) &&
+	    strlen(host) < HTTP_DNS_HOST_LEN)
+	{
+		char *lower = http_strtolower(host);
+		strlcpy(key->host, lower, HTTP_DNS_HOST_LEN);
+		key->port = atoi(port);
+		pfree(lower);
+		ok = true;
+	}
+
+	curl_free(host);
+	curl_free(port);
+	curl_url_cleanup(url);
+	return ok;
+#else
+	return false;
+#endif
+}
+
+/*
+* Look up the transfer's host in the cache, and point curl
+* at the cached address. A cached failure marks the transfer
+* to fail without being run.
+*/
+static void
+http_dns_cache_apply(http_transfer *xfer)
+{
+	http_dns_key key;
+	http_dns_entry *entry;
+	char address[HTTP_DNS_ADDR_LEN];
+	bool found = false;
+	char *resolve;
+
+	if (!g_dns_cache || !http_dns_key_from_uri(xfer->uri, &key))
+		return;
+
+	if (http_dns_cache_usable())
+	{
+		xfer->dns_lookup = true;
+
+		LWLockAcquire(g_dns_lock, LW_SHARED);
+		entry = hash_search(g_dns_cache, &key, HASH_FIND, NULL);
+		if (entry && entry->expires > GetCurrentTimestamp())
+		{
+			strlcpy(address, entry->address, HTTP_DNS_ADDR_LEN);
+			pg_atomic_fetch_add_u64(&(entry->hits), 1);
+			found = true;
+		}
+		LWLockRelease(g_dns_lock);
+
+		if (found && address[0] == '\0')
+		{
+			xfer->fail_fast = CURLE_COULDNT_RESOLVE_HOST;
+			snprintf(xfer->error_buffer, CURL_ERROR_SIZE,
+			         "Could not resolve host: %s (cached)", key.host);
+			return;
+		}
+	}
+
+	/*
+	* Entries given to CURLOPT_RESOLVE are held by the shared
+	* connection cache until removed, so on a miss, or when
+	* the cache is not to be used, clear out anything an
+	* earlier transfer left there.
+	*/
+	if (found)
+		resolve = psprintf(strchr(address, ':') ? "%s:%d:[%s]" : "%s:%d:%s",
+		                   key.host, key.port, address);
+	else
+		resolve = psprintf("-%s:%d", key.host, key.port);
+
+	xfer->resolve = curl_slist_append(NULL, resolve);
+	pfree(resolve);
+	curl_easy_setopt(xfer->handle, CURLOPT_RESOLVE, xfer->resolve);
+	xfer->dns_cached = found;
+}
+
+/*
+* Store (or forget) an address, making room if the cache
+* is full by dropping expired entries, or failing that, the
+* entry closest to expiring.
+*/
+static void
+http_dns_cache_store(const http_dns_key *key, const char *address, int ttl)
+{
+	http_dns_entry *entry;
+	bool found;
+
+	LWLockAcquire(g_dns_lock, LW_EXCLUSIVE);
+
+	if (!address)
+	{
+		hash_search(g_dns_cache, key, HASH_REMOVE, NULL);
+		LWLockRelease(g_dns_lock);
+		return;
+	}
+
+	if (hash_get_num_entries(g_dns_cache) >= http_dns_cache_size &&
+	    !hash_search(g_dns_cache, key, HASH_FIND, NULL))
+	{
+		HASH_SEQ_STATUS status;
+		http_dns_entry *oldest = NULL;
+		TimestampTz now = GetCurrentTimestamp();
+		bool removed = false;
+
+		hash_seq_init(&status, g_dns_cache);
+		while ((entry = hash_seq_search(&status)) != NULL)
+		{
+			if (entry->expires <= now)
+			{
+				hash_search(g_dns_cache, &(entry->key), HASH_REMOVE, NULL);
+				removed = true;
+			}
+			else if (!oldest || entry->expires < oldest->expires)
+				oldest = entry;
+		}
+		if (!removed && oldest)
+			hash_search(g_dns_cache, &(oldest->key), HASH_REMOVE, NULL);
+	}
+
+	entry = hash_search(g_dns_cache, key, HASH_ENTER_NULL, &found);
+	if (entry)
+	{
+		if (!found)
+			pg_atomic_init_u64(&(entry->hits), 0);
+		strlcpy(entry->address, address, HTTP_DNS_ADDR_LEN);
+		entry->expires = TimestampTzPlusMilliseconds(GetCurrentTimestamp(), (int64) ttl * 1000);
+	}
+
+	LWLockRelease(g_dns_lock);
+}
+
+/*
+* Learn from a completed transfer: the address curl connected
+* to, or the failure to find one. A cached address that could
+* not be connected to is dropped, in case it has moved.
+*/
+static void
+http_dns_cache_note(http_transfer *xfer, CURLcode result)
+{
+	http_dns_key key;
+
+	if (!xfer->dns_lookup || xfer->fail_fast != CURLE_OK)
+		return;
+	if (!http_dns_key_from_uri(xfer->uri, &key))
+		return;
+
+	if (xfer->dns_cached)
+	{
+		if (result == CURLE_COULDNT_CONNECT)
+			http_dns_cache_store(&key, NULL, 0);
+	}
+	else if (result == CURLE_COULDNT_RESOLVE_HOST)
+	{
+		if (http_dns_cache_negative_ttl > 0)
+			http_dns_cache_store(&key, "", http_dns_cache_negative_ttl);
+	}
+	else if (result == CURLE_OK)
+	{
+		char *ip = NULL;
+		long redirects = 0;
+
+		/* After a redirect the address may be another host's */
+		curl_easy_getinfo(xfer->handle, CURLINFO_REDIRECT_COUNT, &redirects);
+		if (redirects == 0 &&
+		    curl_easy_getinfo(xfer->handle, CURLINFO_PRIMARY_IP, &ip) == CURLE_OK &&
+		    ip && ip[0] && strlen(ip) < HTTP_DNS_ADDR_LEN)
+			http_dns_cache_store(&key, ip, http_dns_cache_ttl);
+	}
+}
+
+/**
+* List the contents of the shared DNS cache.
+*/
+Datum http_dns_cache_entries(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(http_dns_cache_entries);
+Datum http_dns_cache_entries(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext oldcontext;
+	Tuplestorestate *tupstore;
+	TupleDesc tupdesc;
+	HASH_SEQ_STATUS status;
+	http_dns_entry *entry;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+		!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("%s called with incompatible return type", __func__)));
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupdesc = CreateTupleDescCopy(tupdesc);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	if (!g_dns_cache)
+		return (Datum) 0;
+
+	LWLockAcquire(g_dns_lock, LW_SHARED);
+	hash_seq_init(&status, g_dns_cache);
+	while ((entry = hash_seq_search(&status)) != NULL)
+	{
+		Datum values[5];
+		bool nulls[5] = {false, false, false, false, false};
+
+		values[0] = CStringGetTextDatum(entry->key.host);
+		values[1] = Int32GetDatum(entry->key.port);
+		if (entry->address[0])
+			values[2] = CStringGetTextDatum(entry->address);
+		else
+			nulls[2] = true;
+		values[3] = TimestampTzGetDatum(entry->expires);
+		values[4] = Int64GetDatum((int64) pg_atomic_read_u64(&(entry->hits)));
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+	LWLockRelease(g_dns_lock);
+
+	return (Datum) 0;
+}
+
+/**
+* Empty the shared DNS cache.
+*/
+Datum http_dns_cache_reset(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(http_dns_cache_reset);
+Datum http_dns_cache_reset(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS status;
+	http_dns_entry *entry;
+
+	if (!g_dns_cache)
+		PG_RETURN_VOID();
+
+	LWLockAcquire(g_dns_lock, LW_EXCLUSIVE);
+	hash_seq_init(&status, g_dns_cache);
+	while ((entry = hash_seq_search(&status)) != NULL)
+		hash_search(g_dns_cache, &(entry->key), HASH_REMOVE, NULL);
+	LWLockRelease(g_dns_lock);
+
+	PG_RETURN_VOID();
+}
+
+static void
+http_dns_guc_init(void)
+{
+	DefineCustomIntVariable(
+		"http.dns_cache_size",
+		"Number of host names held in the shared DNS cache.",
+		"Zero disables the cache. Requires loading through shared_preload_libraries.",
+		&http_dns_cache_size,
+		1024, 0, 1000000,
+		PGC_POSTMASTER,
+		0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable(
+		"http.dns_cache_ttl",
+		"Time a resolved address is kept in the shared DNS cache.",
+		"Zero disables use of the cache.",
+		&http_dns_cache_ttl,
+		60, 0, INT_MAX,
+		PGC_SIGHUP,
+		GUC_UNIT_S, NULL, NULL, NULL);
+
+	DefineCustomIntVariable(
+		"http.dns_cache_negative_ttl",
+		"Time a failed host name lookup is kept in the shared DNS cache.",
+		"Zero disables caching of failed lookups.",
+		&http_dns_cache_negative_ttl,
+		5, 0, INT_MAX,
+		PGC_SIGHUP,
+		GUC_UNIT_S, NULL, NULL, NULL);
+}
+
+/*
+* Apply our defaults and any user-supplied curl options
+* to a freshly created or freshly reset handle.
+*/
+static void
+http_handle_init(CURL *handle)
+{
+	http_curlopt *opt = settable_curlopts;
+
+	http_wait_events_init();
+
+	/* Share connections, DNS and TLS sessions across handles */
+	curl_easy_setopt(handle, CURLOPT_SHARE, http_get_share());
+	curl_easy_setopt(handle, CURLOPT_MAXCONNECTS, (long)http_pool_max_connections);
+#if LIBCURL_VERSION_NUM >= 0x074100 /* 7.65.0 */
+	curl_easy_setopt(handle, CURLOPT_MAXAGE_CONN, (long)http_pool_idle_timeout);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x075000 /* 7.80.0 */
+	curl_easy_setopt(handle, CURLOPT_MAXLIFETIME_CONN, (long)http_pool_max_lifetime);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x075700 /* 7.87.0 */
+	/* The CA store is cached on the multi handle, which
+	 * lives as long as the easy handle or our multi handle */
+	curl_easy_setopt(handle, CURLOPT_CA_CACHE_TIMEOUT, (long)http_ca_cache_timeout);
+#endif
+
+	curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, (long)http_http_version);
+#if LIBCURL_VERSION_NUM >= 0x072b00 /* 7.43.0 */
+	/* Rather than open another connection, wait to see whether
+	 * the one being opened to the host can multiplex */
+	if (http_http_version != CURL_HTTP_VERSION_1_0 && http_http_version != CURL_HTTP_VERSION_1_1)
+		curl_easy_setopt(handle, CURLOPT_PIPEWAIT, 1L);
+#endif
 
 	/* Always want a default fast (1 second) connection timeout */
 	/* User can over-ride with http_set_curlopt() if they wish */
 	curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT_MS, 1000L);
 	curl_easy_setopt(handle, CURLOPT_TIMEOUT_MS, 5000L);
 
+	/* Refuse responses announced as too large before reading them */
+	if (http_max_response_bytes > 0)
+		curl_easy_setopt(handle, CURLOPT_MAXFILESIZE_LARGE, (curl_off_t) http_max_response_bytes);
+
 	/* Set the user agent. If not set, use PG_VERSION as default */
 	curl_easy_setopt(handle, CURLOPT_USERAGENT, PG_VERSION_STR);
 
@@ -1007,6 +2241,26 @@ http_get_handle(void)
 			set_curlopt(handle, opt);
 		opt++;
 	}
+}
+
+/* Check/create the global CURL* handle */
+static CURL *
+http_get_handle(void)
+{
+	CURL *handle = g_http_handle;
+
+	/* Initialize the global handle if needed */
+	if (!handle)
+	{
+		handle = curl_easy_init();
+		if (!handle)
+			ereport(ERROR, (errmsg("Unable to initialize CURL")));
+	}
+
+	/* Always reset so GUC-supplied options (e.g. tiny timeouts) are
+	 * reliably enforced on both new and reused handles. */
+	curl_easy_reset(handle);
+	http_handle_init(handle);
 
 	g_http_handle = handle;
 	return handle;
@@ -1025,11 +2279,11 @@ Datum http_reset_curlopt(PG_FUNCTION_ARGS)
 	CURL * handle = http_get_handle();
 	curl_easy_reset(handle);
 
-	/* Clean out the settable_curlopts global cache */
+	/* Put the option GUCs back to their configured values */
 	while (opt->curlopt)
 	{
-		if (opt->curlopt_val) guc_free(opt->curlopt_val);
-		opt->curlopt_val = NULL;
+		(void) set_config_option(opt->curlopt_guc, NULL, PGC_SUSET, PGC_S_SESSION,
+		                         GUC_ACTION_SET, true, 0, false);
 		opt++;
 	}
 
@@ -1123,8 +2377,14 @@ Datum http_set_curlopt(PG_FUNCTION_ARGS)
 	{
 		if (strcasecmp(opt->curlopt_str, curlopt) == 0)
 		{
-			if (opt->curlopt_val) guc_free(opt->curlopt_val);
-			opt->curlopt_val = guc_strdup(ERROR, value);
+			/*
+			 * Set the option through its GUC, so that the value is
+			 * copied to parallel workers along with the other settings.
+			 * Options were always settable from here by any user, hence
+			 * the superuser context.
+			 */
+			(void) set_config_option(opt->curlopt_guc, value, PGC_SUSET, PGC_S_SESSION,
+			                         GUC_ACTION_SET, true, 0, false);
 			PG_RETURN_BOOL(set_curlopt(handle, opt));
 		}
 		opt++;
@@ -1136,15 +2396,13 @@ Datum http_set_curlopt(PG_FUNCTION_ARGS)
 
 
 /**
-* Master HTTP request function, takes in an http_request tuple and outputs
-* an http_response tuple.
+* Read an http_request tuple and configure the transfer handle
+* to run it. The handle in xfer must already be initialized
+* with http_handle_init().
 */
-Datum http_request(PG_FUNCTION_ARGS);
-PG_FUNCTION_INFO_V1(http_request);
-Datum http_request(PG_FUNCTION_ARGS)
+static void
+http_transfer_setup(http_transfer *xfer, HeapTupleHeader rec)
 {
-	/* Input */
-	HeapTupleHeader rec;
 	HeapTupleData tuple;
 	Oid tup_type;
 	int32 tup_typmod;
@@ -1153,46 +2411,16 @@ Datum http_request(PG_FUNCTION_ARGS)
 	Datum *values;
 	bool *nulls;
 
-	char *uri;
 	char *method_str;
 	http_method method;
 
-	/* Processing */
 	CURLcode err;
-	char http_error_buffer[CURL_ERROR_SIZE] = "\0";
-
+	char *http_error_buffer = xfer->error_buffer;
+	CURL *handle = xfer->handle;
 	struct curl_slist *headers = NULL;
-	StringInfoData si_data;
-	StringInfoData si_headers;
-	StringInfoData si_read;
-
-	int http_return;
-	long long_status;
-	int status;
-	char *content_type = NULL;
-	int content_charset = -1;
-
-	/* Output */
-	HeapTuple tuple_out;
-
-	/* Version check */
-	http_check_curl_version(curl_version_info(CURLVERSION_NOW));
-
-	/* We cannot handle a null request */
-	if ( ! PG_ARGISNULL(0) )
-		rec = PG_GETARG_HEAPTUPLEHEADER(0);
-	else
-	{
-		elog(ERROR, "An http_request must be provided");
-		PG_RETURN_NULL();
-	}
-
-	/*************************************************************************
-	* Build and run a curl request from the http_request argument
-	*************************************************************************/
 
 	/* Zero out static memory */
-	memset(http_error_buffer, 0, sizeof(http_error_buffer));
+	memset(xfer->error_buffer, 0, sizeof(xfer->error_buffer));
 
 	/* Extract type info from the tuple itself */
 	tup_type = HeapTupleHeaderGetTypeId(rec);
@@ -1216,342 +2444,4821 @@ Datum http_request(PG_FUNCTION_ARGS)
 	/* Read the URI */
 	if ( nulls[REQ_URI] )
 		elog(ERROR, "http_request.uri is NULL");
-	uri = TextDatumGetCString(values[REQ_URI]);
+	xfer->uri = TextDatumGetCString(values[REQ_URI]);
+	xfer->host = http_uri_host(xfer->uri);
 
 	/* Read the method */
 	if ( nulls[REQ_METHOD] )
 		elog(ERROR, "http_request.method is NULL");
 	method_str = TextDatumGetCString(values[REQ_METHOD]);
 	method = request_type(method_str);
+	xfer->method = method;
 	elog(DEBUG2, "pgsql-http: method_str: '%s', method: %d", method_str, method);
 
-	/* Set up global HTTP handle */
-	g_http_handle = http_get_handle();
-
 	/* Set up the error buffer */
-	CURL_SETOPT(g_http_handle, CURLOPT_ERRORBUFFER, http_error_buffer);
+	CURL_SETOPT(handle, CURLOPT_ERRORBUFFER, http_error_buffer);
 
 	/* Set the target URL */
-	CURL_SETOPT(g_http_handle, CURLOPT_URL, uri);
+	CURL_SETOPT(handle, CURLOPT_URL, xfer->uri);
+
+	/* Let the transfer be found from the handle in multi mode */
+	CURL_SETOPT(handle, CURLOPT_PRIVATE, (void*)xfer);
 
+	/* Use the shared DNS cache, if there is one */
+	http_dns_cache_apply(xfer);
 
 	/* Restrict to just http/https. Leaving unrestricted */
 	/* opens possibility of users requesting file:/// urls */
 	/* locally */
 #if LIBCURL_VERSION_NUM >= 0x075400  /* 7.84.0 */
-	CURL_SETOPT(g_http_handle, CURLOPT_PROTOCOLS_STR, "http,https");
+	CURL_SETOPT(handle, CURLOPT_PROTOCOLS_STR, "http,https");
 #else
-	CURL_SETOPT(g_http_handle, CURLOPT_PROTOCOLS, CURLPROTO_HTTP | CURLPROTO_HTTPS);
+	CURL_SETOPT(handle, CURLOPT_PROTOCOLS, CURLPROTO_HTTP | CURLPROTO_HTTPS);
 #endif
 
-	if ( curlopt_is_set(CURLOPT_TCP_KEEPALIVE) )
+	if ( http_pool_active() )
 	{
 		/* Keep sockets held open */
-		CURL_SETOPT(g_http_handle, CURLOPT_FORBID_REUSE, 0L);
+		CURL_SETOPT(handle, CURLOPT_FORBID_REUSE, 0L);
 	}
 	else
 	{
 		/* Keep sockets from being held open */
-		CURL_SETOPT(g_http_handle, CURLOPT_FORBID_REUSE, 1L);
+		CURL_SETOPT(handle, CURLOPT_FORBID_REUSE, 1L);
 	}
 
 	/* Set up the write-back function */
-	CURL_SETOPT(g_http_handle, CURLOPT_WRITEFUNCTION, http_writeback);
+	CURL_SETOPT(handle, CURLOPT_WRITEFUNCTION, http_writeback);
 
 	/* Set up the write-back buffer */
-	initStringInfo(&si_data);
-	initStringInfo(&si_headers);
-	CURL_SETOPT(g_http_handle, CURLOPT_WRITEDATA, (void*)(&si_data));
-	CURL_SETOPT(g_http_handle, CURLOPT_WRITEHEADER, (void*)(&si_headers));
+	initStringInfo(&(xfer->si_data));
+	if (xfer->binary)
+		appendStringInfoSpaces(&(xfer->si_data), VARHDRSZ);
+	initStringInfo(&(xfer->si_headers));
+	xfer->received = 0;
+	xfer->too_large = false;
+	xfer->spill = NULL;
+	xfer->spill_scope = NULL;
+	CURL_SETOPT(handle, CURLOPT_WRITEDATA, (void*)xfer);
+	CURL_SETOPT(handle, CURLOPT_WRITEHEADER, (void*)(&(xfer->si_headers)));
 
 #if LIBCURL_VERSION_NUM >= 0x072700 /* 7.39.0 */
 	/* Connect the progress callback for interrupt support */
-	CURL_SETOPT(g_http_handle, CURLOPT_XFERINFOFUNCTION, http_progress_callback);
-	CURL_SETOPT(g_http_handle, CURLOPT_NOPROGRESS, 0L);
+	CURL_SETOPT(handle, CURLOPT_XFERINFOFUNCTION, http_progress_callback);
+	CURL_SETOPT(handle, CURLOPT_XFERINFODATA, handle);
+	CURL_SETOPT(handle, CURLOPT_NOPROGRESS, 0L);
 #endif
 
 	/* Set the HTTP content encoding to all curl supports */
-	CURL_SETOPT(g_http_handle, CURLOPT_ACCEPT_ENCODING, "");
+	CURL_SETOPT(handle, CURLOPT_ACCEPT_ENCODING, "");
+
+	if ( method != HTTP_HEAD )
+	{
+		/* Follow redirects, as many as 5 */
+		CURL_SETOPT(handle, CURLOPT_FOLLOWLOCATION, 1L);
+		CURL_SETOPT(handle, CURLOPT_MAXREDIRS, 5L);
+	}
+
+	if ( http_pool_active() )
+	{
+		/* Add a keep alive option to the headers to reuse network sockets */
+		headers = curl_slist_append(headers, "Connection: Keep-Alive");
+	}
+	else
+	{
+		/* Add a close option to the headers to avoid open network sockets */
+		headers = curl_slist_append(headers, "Connection: close");
+	}
+
+	/* Let our charset preference be known */
+	headers = curl_slist_append(headers, "Charsets: utf-8");
+
+	/* Handle optional headers */
+	if ( ! nulls[REQ_HEADERS] )
+	{
+		ArrayType *array = DatumGetArrayTypeP(values[REQ_HEADERS]);
+		headers = header_array_to_slist(array, headers);
+	}
+
+	/* If we have a payload we send it, assuming we're either POST, GET, PATCH, PUT or DELETE or UNKNOWN */
+	if ( ! nulls[REQ_CONTENT] && values[REQ_CONTENT] )
+	{
+		text *content_text;
+		long content_size;
+		char *cstr;
+		char buffer[1024];
+
+		/* Read the content type */
+		if ( nulls[REQ_CONTENT_TYPE] || ! values[REQ_CONTENT_TYPE] )
+			elog(ERROR, "http_request.content_type is NULL");
+		cstr = TextDatumGetCString(values[REQ_CONTENT_TYPE]);
+
+		/* Add content type to the headers */
+		snprintf(buffer, sizeof(buffer), "Content-Type: %s", cstr);
+		headers = curl_slist_append(headers, buffer);
+		pfree(cstr);
+
+		/* Read the content */
+		content_text = DatumGetTextPP(values[REQ_CONTENT]);
+		content_size = VARSIZE_ANY_EXHDR(content_text);
+
+		if ( method == HTTP_GET || method == HTTP_POST || method == HTTP_DELETE )
+		{
+			/* Add the content to the payload */
+			CURL_SETOPT(handle, CURLOPT_POST, 1L);
+			if ( method == HTTP_GET )
+			{
+				/* Force the verb to be GET */
+				CURL_SETOPT(handle, CURLOPT_CUSTOMREQUEST, "GET");
+			}
+			else if( method == HTTP_DELETE )
+			{
+				/* Force the verb to be DELETE */
+				CURL_SETOPT(handle, CURLOPT_CUSTOMREQUEST, "DELETE");
+			}
+
+			xfer->body = VARDATA_ANY(content_text);
+			xfer->body_len = content_size;
+			CURL_SETOPT(handle, CURLOPT_POSTFIELDS, (char *)(VARDATA_ANY(content_text)));
+			CURL_SETOPT(handle, CURLOPT_POSTFIELDSIZE, content_size);
+		}
+		else if ( method == HTTP_PUT || method == HTTP_PATCH || method == HTTP_UNKNOWN )
+		{
+			if ( method == HTTP_PATCH )
+				CURL_SETOPT(handle, CURLOPT_CUSTOMREQUEST, "PATCH");
+
+			/* Assume the user knows what they are doing and pass unchanged */
+			if ( method == HTTP_UNKNOWN )
+				CURL_SETOPT(handle, CURLOPT_CUSTOMREQUEST, method_str);
+
+			/* Read straight out of the content datum, it outlives the transfer */
+			xfer->body = VARDATA_ANY(content_text);
+			xfer->body_len = content_size;
+			xfer->body_pos = 0;
+			CURL_SETOPT(handle, CURLOPT_UPLOAD, 1L);
+			CURL_SETOPT(handle, CURLOPT_READFUNCTION, http_readback);
+			CURL_SETOPT(handle, CURLOPT_READDATA, (void*)xfer);
+			CURL_SETOPT(handle, CURLOPT_INFILESIZE, content_size);
+		}
+		else
+		{
+			/* Never get here */
+			elog(ERROR, "illegal HTTP method");
+		}
+	}
+	else if ( method == HTTP_DELETE )
+	{
+		CURL_SETOPT(handle, CURLOPT_CUSTOMREQUEST, "DELETE");
+	}
+	else if ( method == HTTP_HEAD )
+	{
+		CURL_SETOPT(handle, CURLOPT_NOBODY, 1L);
+	}
+	else if ( method == HTTP_PUT || method == HTTP_POST )
+	{
+		/* If we had a content we do not reach that part */
+		elog(ERROR, "http_request.content is NULL");
+	}
+	else if ( method == HTTP_UNKNOWN ){
+		/* Assume the user knows what they are doing and pass unchanged */
+		CURL_SETOPT(handle, CURLOPT_CUSTOMREQUEST, method_str);
+	}
+
+	pfree(method_str);
+
+	/* Set the headers */
+	xfer->headers = headers;
+	CURL_SETOPT(handle, CURLOPT_HTTPHEADER, headers);
+
+	/* Clean up some input things we don't need anymore */
+	ReleaseTupleDesc(tup_desc);
+	pfree(values);
+	pfree(nulls);
+}
+
+/**
+* Release the memory held by a transfer. The curl handle
+* itself is left for the caller to clean up or reuse.
+*/
+static void
+http_transfer_cleanup(http_transfer *xfer)
+{
+	if (xfer->headers)
+		curl_slist_free_all(xfer->headers);
+	xfer->headers = NULL;
+
+	if (xfer->resolve)
+		curl_slist_free_all(xfer->resolve);
+	xfer->resolve = NULL;
+
+	/* A rolled back spill subtransaction has closed the file already */
+	if (xfer->spill && !(xfer->spill_scope && xfer->spill_scope->lost))
+		BufFileClose(xfer->spill);
+	xfer->spill = NULL;
+
+	if (xfer->si_headers.data)
+		pfree(xfer->si_headers.data);
+	if (xfer->si_data.data)
+		pfree(xfer->si_data.data);
+	xfer->si_headers.data = xfer->si_data.data = NULL;
+	xfer->body = NULL;
+}
+
+/*
+* Read the character set name out of the content type,
+* if there is one in there, and return its encoding or -1.
+*/
+static int
+http_content_charset(const char *content_type)
+{
+	List *ctl;
+	ListCell *lc;
+
+	if ( ! content_type )
+		return -1;
+
+	/* text/html; charset=iso-8859-1 */
+	if ( SplitIdentifierString(pstrdup(content_type), ';', &ctl) )
+	{
+		foreach(lc, ctl)
+		{
+			/* charset=iso-8859-1 */
+			const char *param = (const char *) lfirst(lc);
+			const char *paramtype = "charset=";
+			if ( http_strcasestr(param, paramtype) )
+			{
+				/* iso-8859-1 */
+				const char *charset = param + strlen(paramtype);
+				return pg_char_to_encoding(charset);
+			}
+		}
+	}
+	return -1;
+}
+
+/*
+* Responses with bytea content are returned without any
+* transcoding, straight from the receive buffer.
+*/
+static bool
+http_response_is_binary(TupleDesc tup_desc)
+{
+	return TupleDescAttr(tup_desc, RESP_CONTENT)->atttypid == BYTEAOID;
+}
+
+/**
+* Build an http_response tuple from the parts of a completed
+* transfer.
+*/
+static HeapTuple
+http_response_form_tuple(TupleDesc tup_desc, long long_status, const char *content_type, StringInfo si_headers, StringInfo si_data)
+{
+	int ncolumns;
+	Datum *values;
+	bool *nulls;
+	int status;
+	int content_charset = -1;
+	HeapTuple tuple_out;
+
+	ncolumns = tup_desc->natts;
+	values = palloc0(sizeof(Datum)*ncolumns);
+	nulls = palloc0(sizeof(bool)*ncolumns);
+
+	/* Status code */
+	status = long_status;
+	values[RESP_STATUS] = Int32GetDatum(status);
+	nulls[RESP_STATUS] = false;
+
+	/* Content type */
+	if ( content_type )
+	{
+		values[RESP_CONTENT_TYPE] = CStringGetTextDatum(content_type);
+		nulls[RESP_CONTENT_TYPE] = false;
+		content_charset = http_content_charset(content_type);
+	}
+	else
+	{
+		values[RESP_CONTENT_TYPE] = (Datum)0;
+		nulls[RESP_CONTENT_TYPE] = true;
+	}
+
+	/* Headers array */
+	if ( si_headers->len )
+	{
+		values[RESP_HEADERS] = PointerGetDatum(header_string_to_array(si_headers));
+		nulls[RESP_HEADERS] = false;
+	}
+	else
+	{
+		values[RESP_HEADERS] = (Datum)0;
+		nulls[RESP_HEADERS] = true;
+	}
+
+	/* Content */
+	if ( http_response_is_binary(tup_desc) )
+	{
+		/* The buffer was started with room for the varlena header */
+		Assert(si_data->len >= VARHDRSZ);
+		if ( si_data->len > VARHDRSZ )
+		{
+			SET_VARSIZE(si_data->data, si_data->len);
+			values[RESP_CONTENT] = PointerGetDatum(si_data->data);
+			nulls[RESP_CONTENT] = false;
+		}
+		else
+		{
+			values[RESP_CONTENT] = (Datum)0;
+			nulls[RESP_CONTENT] = true;
+		}
+	}
+	else if ( si_data->len )
+	{
+		char *content_str;
+		size_t content_len;
+		elog(DEBUG2, "pgsql-http: content_charset = %d", content_charset);
+
+		/* Apply character transcoding if necessary */
+		if ( content_charset < 0 )
+		{
+			content_str = si_data->data;
+			content_len = si_data->len;
+		}
+		else
+		{
+			content_str = pg_any_to_server(si_data->data, si_data->len, content_charset);
+			content_len = strlen(content_str);
+		}
+
+		values[RESP_CONTENT] = PointerGetDatum(cstring_to_text_with_len(content_str, content_len));
+		nulls[RESP_CONTENT] = false;
+	}
+	else
+	{
+		values[RESP_CONTENT] = (Datum)0;
+		nulls[RESP_CONTENT] = true;
+	}
+
+	/* Build up a tuple from values/nulls lists */
+	tuple_out = heap_form_tuple(tup_desc, values, nulls);
+
+	pfree(values);
+	pfree(nulls);
+	return tuple_out;
+}
+
+/*************************************************************************
+* Shared response cache
+*
+* When loaded by shared_preload_libraries with http.cache_size
+* set, fresh responses to GET and HEAD requests are kept in
+* shared memory for all backends, and requests for them are
+* answered without touching the network. Only responses with
+* an explicit lifetime (Cache-Control max-age or s-maxage, or
+* Expires) are stored, and the least recently used are dropped
+* to make room. The responses live in a dynamic shared memory
+* area created in place, limited to the size of the cache.
+*************************************************************************/
+
+typedef struct {
+	uint64 key;          /* hash of the method and URI */
+	dlist_node lru;
+	dsa_pointer item;
+	Size size;
+	TimestampTz expires;
+} http_cache_entry;
+
+typedef struct {
+	int32 status;
+	bool has_content_type;
+	Size key_len;        /* all the lengths exclude the terminators */
+	Size vary_names_len;
+	Size vary_values_len;
+	Size content_type_len;
+	Size headers_len;
+	Size content_len;
+	/* key, vary names, vary values and content type, each nul
+	 * terminated, then the raw headers and the content */
+	char data[FLEXIBLE_ARRAY_MEMBER];
+} http_cache_item;
+
+typedef struct {
+	dlist_head lru;      /* most recently used first */
+	Size bytes;
+	pg_atomic_uint64 hits;
+	pg_atomic_uint64 misses;
+	pg_atomic_uint64 stores;
+	pg_atomic_uint64 evictions;
+} http_cache_shared;
+
+/* Parsed Cache-Control directives, -1 for an absent age */
+typedef struct {
+	bool no_store;
+	bool no_cache;
+	bool is_private;
+	int max_age;
+	int s_maxage;
+} http_cache_control;
+
+/* Roughly one index entry per 4kB of cache */
+#define HTTP_CACHE_ENTRIES_PER_MB 256
+
+/* Response cache GUC variables */
+static int http_cache_size = 0;
+
+/* Response cache in shared memory */
+static http_cache_shared *g_cache = NULL;
+static HTAB *g_cache_index = NULL;
+static LWLock *g_cache_lock = NULL;
+static void *g_cache_place = NULL;
+static dsa_area *g_cache_area = NULL;
+
+static Size
+http_cache_area_size(void)
+{
+	return (Size) http_cache_size * 1024 * 1024;
+}
+
+static long
+http_cache_max_entries(void)
+{
+	return (long) http_cache_size * HTTP_CACHE_ENTRIES_PER_MB;
+}
+
+static Size
+http_cache_shmem_size(void)
+{
+	Size size;
+
+	if (http_cache_size <= 0)
+		return 0;
+	size = MAXALIGN(sizeof(http_cache_shared));
+	size = add_size(size, hash_estimate_size(http_cache_max_entries(), sizeof(http_cache_entry)));
+	size = add_size(size, http_cache_area_size());
+	return size;
+}
+
+static void
+http_cache_shmem_request(void)
+{
+	if (http_cache_size > 0)
+		RequestNamedLWLockTranche("pgsql-http cache", 1);
+}
+
+static void
+http_cache_shmem_startup(void)
+{
+	HASHCTL info;
+	bool found;
+
+	if (http_cache_size <= 0)
+		return;
+
+	g_cache_lock = &(GetNamedLWLockTranche("pgsql-http cache")->lock);
+	g_cache = ShmemInitStruct("pgsql-http response cache", sizeof(http_cache_shared), &found);
+	g_cache_place = ShmemInitStruct("pgsql-http response cache area", http_cache_area_size(), &found);
+	if (!found)
+	{
+		dsa_area *area;
+
+		dlist_init(&(g_cache->lru));
+		g_cache->bytes = 0;
+		pg_atomic_init_u64(&(g_cache->hits), 0);
+		pg_atomic_init_u64(&(g_cache->misses), 0);
+		pg_atomic_init_u64(&(g_cache->stores), 0);
+		pg_atomic_init_u64(&(g_cache->evictions), 0);
+
+		/* The area may never grow past the space set aside for it */
+		area = dsa_create_in_place(g_cache_place, http_cache_area_size(), g_cache_lock->tranche, NULL);
+		dsa_set_size_limit(area, http_cache_area_size());
+		dsa_pin(area);
+		dsa_detach(area);
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(uint64);
+	info.entrysize = sizeof(http_cache_entry);
+	g_cache_index = ShmemInitHash("pgsql-http response cache index",
+	                              http_cache_max_entries(), http_cache_max_entries(),
+	                              &info, HASH_ELEM | HASH_BLOBS);
+}
+
+/* Attach to the response area, once per backend */
+static dsa_area *
+http_cache_get_area(void)
+{
+	if (!g_cache_area)
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+		g_cache_area = dsa_attach_in_place(g_cache_place, NULL);
+		dsa_pin_mapping(g_cache_area);
+		on_shmem_exit(dsa_on_shmem_exit_release_in_place, PointerGetDatum(g_cache_place));
+		MemoryContextSwitchTo(oldcontext);
+	}
+	return g_cache_area;
+}
+
+/*
+* If the line is the named header, return its value with the
+* surrounding whitespace trimmed, otherwise NULL.
+*/
+static const char *
+http_header_line_value(const char *line, size_t len, const char *name, size_t *value_len)
+{
+	size_t name_len = strlen(name);
+	const char *value, *end = line + len;
+
+	if (len <= name_len || line[name_len] != ':' || pg_strncasecmp(line, name, name_len) != 0)
+		return NULL;
+
+	value = line + name_len + 1;
+	while (value < end && HTTP_IS_WS(*value))
+		value++;
+	while (end > value && (HTTP_IS_WS(end[-1]) || end[-1] == '\r'))
+		end--;
+	*value_len = end - value;
+	return value;
+}
+
+/*
+* Read a header from the final block of the response headers,
+* joining repeated fields with commas. NULL if it is absent.
+*/
+static char *
+http_response_header(StringInfo si, const char *name)
+{
+	StringInfoData value;
+	const char *p = si->data;
+	const char *end = si->data + si->len;
+	bool found = false;
+
+	initStringInfo(&value);
+	while (p < end)
+	{
+		const char *eol = memchr(p, '\n', end - p);
+		size_t len = (eol ? eol : end) - p;
+		const char *v;
+		size_t v_len;
+
+		/* A status line starts a new block */
+		if (len >= 5 && strncmp(p, "HTTP/", 5) == 0)
+		{
+			resetStringInfo(&value);
+			found = false;
+		}
+		else if ((v = http_header_line_value(p, len, name, &v_len)) != NULL)
+		{
+			if (found)
+				appendStringInfoString(&value, ", ");
+			appendBinaryStringInfo(&value, v, v_len);
+			found = true;
+		}
+		p = eol ? eol + 1 : end;
+	}
+
+	if (!found)
+	{
+		pfree(value.data);
+		return NULL;
+	}
+	return value.data;
+}
+
+/*
+* Read a header from the request header list, in the same
+* way. NULL if it is absent.
+*/
+static char *
+http_request_header(const struct curl_slist *headers, const char *name)
+{
+	StringInfoData value;
+	bool found = false;
+
+	initStringInfo(&value);
+	for (; headers; headers = headers->next)
+	{
+		const char *v;
+		size_t v_len;
+
+		if ((v = http_header_line_value(headers->data, strlen(headers->data), name, &v_len)) != NULL)
+		{
+			if (found)
+				appendStringInfoString(&value, ", ");
+			appendBinaryStringInfo(&value, v, v_len);
+			found = true;
+		}
+	}
+
+	if (!found)
+	{
+		pfree(value.data);
+		return NULL;
+	}
+	return value.data;
+}
+
+/*
+* Cut the next separated item out of a list being walked
+* in place, trimmed of whitespace. NULL at the end.
+*/
+static char *
+http_next_token(char **cursor, char sep)
+{
+	char *start = *cursor;
+	char *end;
+
+	if (!start)
+		return NULL;
+
+	end = strchr(start, sep);
+	*cursor = end ? end + 1 : NULL;
+	if (end)
+		*end = '\0';
+	else
+		end = start + strlen(start);
+
+	while (HTTP_IS_WS(*start))
+		start++;
+	while (end > start && HTTP_IS_WS(end[-1]))
+		*--end = '\0';
+	return start;
+}
+
+static void
+http_cache_control_parse(const char *value, http_cache_control *cc)
+{
+	char *copy, *cursor, *tok;
+
+	memset(cc, 0, sizeof(http_cache_control));
+	cc->max_age = cc->s_maxage = -1;
+	if (!value)
+		return;
+
+	copy = cursor = pstrdup(value);
+	while ((tok = http_next_token(&cursor, ',')) != NULL)
+	{
+		char *arg;
+
+		/* Directives with an argument, quoted or not */
+		if ((arg = strchr(tok, '=')) != NULL)
+		{
+			*arg++ = '\0';
+			if (*arg == '"')
+				arg++;
+		}
+
+		if (pg_strcasecmp(tok, "no-store") == 0)
+			cc->no_store = true;
+		else if (pg_strcasecmp(tok, "no-cache") == 0)
+			cc->no_cache = true;
+		else if (pg_strcasecmp(tok, "private") == 0)
+			cc->is_private = true;
+		else if (pg_strcasecmp(tok, "max-age") == 0 && arg)
+			cc->max_age = Max(atoi(arg), 0);
+		else if (pg_strcasecmp(tok, "s-maxage") == 0 && arg)
+			cc->s_maxage = Max(atoi(arg), 0);
+	}
+	pfree(copy);
+}
+
+/*
+* Credentials the server can see outside the request headers
+* make a response private to whoever set them.
+*/
+static bool
+http_cache_credentials_set(void)
+{
+	return curlopt_is_set(CURLOPT_USERPWD) ||
+	       curlopt_is_set(CURLOPT_TLSAUTH_USERNAME) ||
+	       curlopt_is_set(CURLOPT_SSLCERT) ||
+	       curlopt_is_set(CURLOPT_SSLKEY)
+#if LIBCURL_VERSION_NUM >= 0x074700 /* 7.71.0 */
+	       || curlopt_is_set(CURLOPT_SSLCERT_BLOB)
+	       || curlopt_is_set(CURLOPT_SSLKEY_BLOB)
+#endif
+	       ;
+}
+
+/* Options that change how surely the server is the real one */
+static const CURLoption http_cache_verify_curlopts[] = {
+	CURLOPT_CAINFO,
+#if LIBCURL_VERSION_NUM >= 0x072500 /* 7.37.0 */
+	CURLOPT_SSL_VERIFYHOST,
+	CURLOPT_SSL_VERIFYPEER,
+#endif
+#if LIBCURL_VERSION_NUM >= 0x073400 /* 7.52.0 */
+	CURLOPT_PROXY_CAINFO,
+#endif
+	0
+};
+
+/*
+* A session that routes or verifies differently from the
+* configured way may be answered by another server, whose
+* responses are not to be shared, nor answered from those
+* of the real one.
+*/
+static bool
+http_cache_route_changed(void)
+{
+	return curlopts_are_changed(http_dns_route_curlopts) ||
+	       curlopts_are_changed(http_cache_verify_curlopts);
+}
+
+static char *
+http_cache_key(const http_transfer *xfer)
+{
+	return psprintf("%s %s", xfer->method == HTTP_HEAD ? "HEAD" : "GET", xfer->uri);
+}
+
+/*
+* The values of the request headers a response varies on,
+* in the order of the names, one per line.
+*/
+static char *
+http_cache_vary_values(const struct curl_slist *headers, const char *names)
+{
+	StringInfoData values;
+	char *copy = pstrdup(names);
+	char *cursor = copy;
+	char *name;
+
+	initStringInfo(&values);
+	while (*names && (name = http_next_token(&cursor, '\n')) != NULL)
+	{
+		char *value = http_request_header(headers, name);
+		if (value)
+		{
+			appendStringInfoString(&values, value);
+			pfree(value);
+		}
+		appendStringInfoChar(&values, '\n');
+	}
+	pfree(copy);
+	return values.data;
+}
+
+static void
+http_cache_remove(dsa_area *area, http_cache_entry *entry)
+{
+	dlist_delete(&(entry->lru));
+	dsa_free(area, entry->item);
+	g_cache->bytes -= entry->size;
+	hash_search(g_cache_index, &(entry->key), HASH_REMOVE, NULL);
+}
+
+static bool
+http_cache_evict(dsa_area *area)
+{
+	if (dlist_is_empty(&(g_cache->lru)))
+		return false;
+	http_cache_remove(area, dlist_container(http_cache_entry, lru, dlist_tail_node(&(g_cache->lru))));
+	pg_atomic_fetch_add_u64(&(g_cache->evictions), 1);
+	return true;
+}
+
+/*
+* Answer the transfer from the cache if a fresh response is
+* there, building the tuple just as for a network response.
+* Also decides whether the response may be stored afterwards.
+*/
+static bool
+http_cache_lookup(http_transfer *xfer, TupleDesc tup_desc, HeapTuple *tuple_out)
+{
+	http_cache_control cc;
+	char *request_cc;
+	char *key;
+	uint64 hash;
+	dsa_area *area;
+	http_cache_entry *entry;
+	bool hit = false;
+	int32 status = 0;
+	char *content_type = NULL;
+	char *value;
+
+	xfer->cache_store = false;
+	if (!g_cache || (xfer->method != HTTP_GET && xfer->method != HTTP_HEAD) || xfer->body)
+		return false;
+
+	/* Responses to credentialed requests are not ours to share */
+	if (http_cache_credentials_set() || http_cache_route_changed())
+		return false;
+	if ((value = http_request_header(xfer->headers, "Authorization")) != NULL ||
+	    (value = http_request_header(xfer->headers, "Cookie")) != NULL)
+	{
+		pfree(value);
+		return false;
+	}
+
+	request_cc = http_request_header(xfer->headers, "Cache-Control");
+	http_cache_control_parse(request_cc, &cc);
+	if (cc.no_store)
+		return false;
+	xfer->cache_store = true;
+
+	/* Asked to go to the origin, but the answer may still be kept */
+	if (cc.no_cache || cc.max_age == 0)
+		return false;
+	if (!request_cc && (value = http_request_header(xfer->headers, "Pragma")) != NULL)
+	{
+		bool no_cache = pg_strncasecmp(value, "no-cache", 8) == 0;
+		pfree(value);
+		if (no_cache)
+			return false;
+	}
+
+	key = http_cache_key(xfer);
+	hash = hash_bytes_extended((const unsigned char *) key, strlen(key), 0);
+	area = http_cache_get_area();
+
+	/* Moving the entry to the front of the list needs an exclusive lock */
+	LWLockAcquire(g_cache_lock, LW_EXCLUSIVE);
+	entry = hash_search(g_cache_index, &hash, HASH_FIND, NULL);
+	if (entry)
+	{
+		http_cache_item *item = dsa_get_address(area, entry->item);
+		char *vary_names = item->data + item->key_len + 1;
+		char *vary_values = vary_names + item->vary_names_len + 1;
+		char *item_type = vary_values + item->vary_values_len + 1;
+		char *headers = item_type + item->content_type_len + 1;
+
+		if (entry->expires <= GetCurrentTimestamp())
+			http_cache_remove(area, entry);
+		else if (strcmp(item->data, key) == 0)
+		{
+			char *values = http_cache_vary_values(xfer->headers, vary_names);
+			if (strcmp(values, vary_values) == 0)
+			{
+				hit = true;
+				status = item->status;
+				if (item->has_content_type)
+					content_type = pstrdup(item_type);
+				appendBinaryStringInfo(&(xfer->si_headers), headers, item->headers_len);
+				appendBinaryStringInfo(&(xfer->si_data), headers + item->headers_len, item->content_len);
+				dlist_move_head(&(g_cache->lru), &(entry->lru));
+			}
+			pfree(values);
+		}
+	}
+	LWLockRelease(g_cache_lock);
+
+	pfree(key);
+	if (!hit)
+	{
+		pg_atomic_fetch_add_u64(&(g_cache->misses), 1);
+		return false;
+	}
+
+	pg_atomic_fetch_add_u64(&(g_cache->hits), 1);
+	elog(DEBUG2, "pgsql-http: cache hit for '%s'", xfer->uri);
+	*tuple_out = http_response_form_tuple(tup_desc, status, content_type, &(xfer->si_headers), &(xfer->si_data));
+	return true;
+}
+
+/*
+* Keep a completed response in the cache, if it says how
+* long it stays fresh and nothing forbids storing it.
+*/
+static void
+http_cache_store(http_transfer *xfer)
+{
+	long status = 0;
+	long redirects = 0;
+	char *content_type = NULL;
+	char *value;
+	http_cache_control cc;
+	time_t now = time(NULL);
+	time_t date = -1;
+	int64 lifetime, age = 0;
+	StringInfoData names;
+	char *values;
+	char *key;
+	const char *content;
+	Size content_len, size;
+	uint64 hash;
+	dsa_area *area;
+	dsa_pointer ptr;
+	http_cache_item *item;
+	http_cache_entry *entry;
+	char *p;
+
+	if (!xfer->cache_store)
+		return;
+
+	curl_easy_getinfo(xfer->handle, CURLINFO_RESPONSE_CODE, &status);
+	curl_easy_getinfo(xfer->handle, CURLINFO_CONTENT_TYPE, &content_type);
+	curl_easy_getinfo(xfer->handle, CURLINFO_REDIRECT_COUNT, &redirects);
+
+	/* Final statuses that may be stored, and no detours on the way */
+	if (redirects > 0)
+		return;
+	switch (status)
+	{
+		case 200: case 203: case 204: case 300: case 301: case 308:
+		case 404: case 405: case 410: case 414: case 501:
+			break;
+		default:
+			return;
+	}
+
+	value = http_response_header(&(xfer->si_headers), "Cache-Control");
+	http_cache_control_parse(value, &cc);
+	if (cc.no_store || cc.no_cache || cc.is_private)
+		return;
+
+	if ((value = http_response_header(&(xfer->si_headers), "Date")) != NULL)
+		date = curl_getdate(value, NULL);
+
+	/* How long the response was fresh for when it was sent */
+	if (cc.s_maxage >= 0)
+		lifetime = cc.s_maxage;
+	else if (cc.max_age >= 0)
+		lifetime = cc.max_age;
+	else if ((value = http_response_header(&(xfer->si_headers), "Expires")) != NULL)
+	{
+		time_t expires = curl_getdate(value, NULL);
+		lifetime = expires < 0 ? 0 : (int64) expires - (date < 0 ? now : date);
+	}
+	else
+		return;
+
+	/* Less the time it has already spent in caches or on the way */
+	if ((value = http_response_header(&(xfer->si_headers), "Age")) != NULL)
+		age = Max(atoi(value), 0);
+	if (date >= 0 && now - date > age)
+		age = now - date;
+	if (lifetime - age <= 0)
+		return;
+
+	/* Remember the request headers the response depends on */
+	initStringInfo(&names);
+	if ((value = http_response_header(&(xfer->si_headers), "Vary")) != NULL)
+	{
+		char *cursor = value;
+		char *name;
+		while ((name = http_next_token(&cursor, ',')) != NULL)
+		{
+			if (strcmp(name, "*") == 0)
+				return;
+			if (*name)
+			{
+				char *lower = http_strtolower(name);
+				if (names.len)
+					appendStringInfoChar(&names, '\n');
+				appendStringInfoString(&names, lower);
+				pfree(lower);
+			}
+		}
+	}
+	values = http_cache_vary_values(xfer->headers, names.data);
+
+	content = xfer->si_data.data;
+	content_len = xfer->si_data.len;
+	if (xfer->binary)
+	{
+		content += VARHDRSZ;
+		content_len -= VARHDRSZ;
+	}
+
+	key = http_cache_key(xfer);
+	size = offsetof(http_cache_item, data) +
+	       strlen(key) + 1 + names.len + 1 + strlen(values) + 1 +
+	       (content_type ? strlen(content_type) : 0) + 1 +
+	       xfer->si_headers.len + content_len;
+
+	/* Do not let one response push out most of the cache */
+	if (size > http_cache_area_size() / 8)
+		return;
+
+	hash = hash_bytes_extended((const unsigned char *) key, strlen(key), 0);
+	area = http_cache_get_area();
+
+	LWLockAcquire(g_cache_lock, LW_EXCLUSIVE);
+
+	if ((entry = hash_search(g_cache_index, &hash, HASH_FIND, NULL)) != NULL)
+		http_cache_remove(area, entry);
+
+	/* Make room, oldest first */
+	while ((ptr = dsa_allocate_extended(area, size, DSA_ALLOC_HUGE | DSA_ALLOC_NO_OOM)) == InvalidDsaPointer)
+	{
+		if (!http_cache_evict(area))
+			break;
+	}
+	while (ptr != InvalidDsaPointer && hash_get_num_entries(g_cache_index) >= http_cache_max_entries())
+	{
+		if (!http_cache_evict(area))
+			break;
+	}
+	entry = ptr == InvalidDsaPointer ? NULL : hash_search(g_cache_index, &hash, HASH_ENTER_NULL, NULL);
+
+	if (entry)
+	{
+		item = dsa_get_address(area, ptr);
+		item->status = status;
+		item->has_content_type = content_type != NULL;
+		item->key_len = strlen(key);
+		item->vary_names_len = names.len;
+		item->vary_values_len = strlen(values);
+		item->content_type_len = content_type ? strlen(content_type) : 0;
+		item->headers_len = xfer->si_headers.len;
+		item->content_len = content_len;
+
+		p = item->data;
+		memcpy(p, key, item->key_len + 1);
+		p += item->key_len + 1;
+		memcpy(p, names.data, item->vary_names_len + 1);
+		p += item->vary_names_len + 1;
+		memcpy(p, values, item->vary_values_len + 1);
+		p += item->vary_values_len + 1;
+		if (content_type)
+			memcpy(p, content_type, item->content_type_len);
+		p[item->content_type_len] = '\0';
+		p += item->content_type_len + 1;
+		memcpy(p, xfer->si_headers.data, item->headers_len);
+		p += item->headers_len;
+		memcpy(p, content, content_len);
+
+		entry->item = ptr;
+		entry->size = size;
+		entry->expires = TimestampTzPlusMilliseconds(GetCurrentTimestamp(), (lifetime - age) * 1000);
+		dlist_push_head(&(g_cache->lru), &(entry->lru));
+		g_cache->bytes += size;
+		pg_atomic_fetch_add_u64(&(g_cache->stores), 1);
+	}
+	else if (ptr != InvalidDsaPointer)
+		dsa_free(area, ptr);
+
+	LWLockRelease(g_cache_lock);
+}
+
+/**
+* Drop the cached responses for URIs matching a LIKE pattern,
+* returning the number dropped.
+*/
+Datum http_cache_invalidate(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(http_cache_invalidate);
+Datum http_cache_invalidate(PG_FUNCTION_ARGS)
+{
+	text *pattern = PG_GETARG_TEXT_PP(0);
+	HASH_SEQ_STATUS status;
+	http_cache_entry *entry;
+	dsa_area *area;
+	int64 removed = 0;
+
+	if (!g_cache)
+		PG_RETURN_INT64(0);
+
+	/* Find out about a malformed pattern before taking the lock */
+	DirectFunctionCall2Coll(textlike, DEFAULT_COLLATION_OID,
+	                        PointerGetDatum(cstring_to_text("")), PointerGetDatum(pattern));
+
+	area = http_cache_get_area();
+	LWLockAcquire(g_cache_lock, LW_EXCLUSIVE);
+	hash_seq_init(&status, g_cache_index);
+	while ((entry = hash_seq_search(&status)) != NULL)
+	{
+		http_cache_item *item = dsa_get_address(area, entry->item);
+		const char *uri = strchr(item->data, ' ') + 1;
+		text *uri_text = cstring_to_text(uri);
+
+		if (DatumGetBool(DirectFunctionCall2Coll(textlike, DEFAULT_COLLATION_OID,
+		                                         PointerGetDatum(uri_text), PointerGetDatum(pattern))))
+		{
+			http_cache_remove(area, entry);
+			removed++;
+		}
+		pfree(uri_text);
+	}
+	LWLockRelease(g_cache_lock);
+
+	PG_RETURN_INT64(removed);
+}
+
+/**
+* Report the size and effectiveness of the response cache.
+*/
+Datum http_cache_stats(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(http_cache_stats);
+Datum http_cache_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc tup_desc;
+	Datum values[6];
+	bool nulls[6] = {false, false, false, false, false, false};
+
+	if (get_call_result_type(fcinfo, NULL, &tup_desc) != TYPEFUNC_COMPOSITE)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("%s called with incompatible return type", __func__)));
+
+	if (g_cache)
+	{
+		LWLockAcquire(g_cache_lock, LW_SHARED);
+		values[0] = Int64GetDatum(hash_get_num_entries(g_cache_index));
+		values[1] = Int64GetDatum((int64) g_cache->bytes);
+		LWLockRelease(g_cache_lock);
+		values[2] = Int64GetDatum((int64) pg_atomic_read_u64(&(g_cache->hits)));
+		values[3] = Int64GetDatum((int64) pg_atomic_read_u64(&(g_cache->misses)));
+		values[4] = Int64GetDatum((int64) pg_atomic_read_u64(&(g_cache->stores)));
+		values[5] = Int64GetDatum((int64) pg_atomic_read_u64(&(g_cache->evictions)));
+	}
+	else
+	{
+		int i;
+		for (i = 0; i < 6; i++)
+			values[i] = Int64GetDatum(0);
+	}
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tup_desc), values, nulls)));
+}
+
+static void
+http_cache_guc_init(void)
+{
+	DefineCustomIntVariable(
+		"http.cache_size",
+		"Size of the shared response cache.",
+		"Zero disables the cache. Requires loading through shared_preload_libraries.",
+		&http_cache_size,
+		0, 0, 1024 * 1024,
+		PGC_POSTMASTER,
+		GUC_UNIT_MB, NULL, NULL, NULL);
+}
+
+/*************************************************************************
+* Per-host rate limits
+*
+* http.rate_limits holds a request rate for each of a list of
+* hosts, enforced with a token bucket per host. When loaded by
+* shared_preload_libraries the buckets are in shared memory and
+* the limits apply to the whole cluster, otherwise each backend
+* keeps its own. A request finding the bucket empty waits for
+* a token, up to http.rate_limit_wait, and then fails. Where
+* many transfers are driven at once, a held back transfer is
+* set aside instead, and the others keep running meanwhile.
+*************************************************************************/
+
+#define HTTP_RATE_LIMIT_HOSTS 256
+
+typedef struct {
+	char host[HTTP_DNS_HOST_LEN];
+	double rate;         /* tokens per second */
+	double burst;        /* most tokens a bucket holds */
+} http_rate_limit;
+
+typedef struct {
+	char host[HTTP_DNS_HOST_LEN];
+	double tokens;
+	TimestampTz updated;
+} http_rate_bucket;
+
+/* Rate limit GUC variables */
+static char *http_rate_limits = NULL;
+static int http_rate_limit_max_wait = 10000;
+
+/* The limits as last parsed by this backend */
+static char *g_rate_limits_parsed = NULL;
+static http_rate_limit *g_rate_limits = NULL;
+static int g_rate_limits_count = 0;
+
+/* Token buckets, shared when possible */
+static HTAB *g_rate_buckets = NULL;
+static LWLock *g_rate_lock = NULL;
+
+static Size
+http_rate_shmem_size(void)
+{
+	return hash_estimate_size(HTTP_RATE_LIMIT_HOSTS, sizeof(http_rate_bucket));
+}
+
+static void
+http_rate_shmem_request(void)
+{
+	RequestNamedLWLockTranche("pgsql-http rate limits", 1);
+}
+
+static void
+http_rate_shmem_startup(void)
+{
+	HASHCTL info;
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = HTTP_DNS_HOST_LEN;
+	info.entrysize = sizeof(http_rate_bucket);
+	g_rate_buckets = ShmemInitHash("pgsql-http rate limits",
+	                               HTTP_RATE_LIMIT_HOSTS, HTTP_RATE_LIMIT_HOSTS,
+	                               &info, HASH_ELEM | HASH_BLOBS);
+	g_rate_lock = &(GetNamedLWLockTranche("pgsql-http rate limits")->lock);
+}
+
+/*
+* Parse a list like 'api.example.com=50/s, example.org=600/min'
+* into an array of limits. On a syntax error returns false,
+* with the offending entry in *bad.
+*/
+static bool
+http_rate_limits_parse(const char *value, http_rate_limit **limits, int *nlimits, char **bad)
+{
+	char *copy = pstrdup(value ? value : "");
+	char *cursor = copy;
+	char *item;
+	int size = 8;
+
+	*nlimits = 0;
+	*limits = palloc(size * sizeof(http_rate_limit));
+	while ((item = http_next_token(&cursor, ',')) != NULL)
+	{
+		char *rate_str, *unit, *end, *lower;
+		double rate, period;
+		http_rate_limit *limit;
+
+		if (*item == '\0')
+			continue;
+
+		if ((rate_str = strchr(item, '=')) == NULL || (unit = strchr(rate_str, '/')) == NULL)
+			goto bad_item;
+		*rate_str++ = '\0';
+		*unit++ = '\0';
+
+		rate = strtod(rate_str, &end);
+		if (end == rate_str || *end != '\0' || !(rate > 0))
+			goto bad_item;
+		if (strcmp(unit, "s") == 0)
+			period = 1;
+		else if (strcmp(unit, "min") == 0)
+			period = 60;
+		else if (strcmp(unit, "h") == 0)
+			period = 3600;
+		else
+			goto bad_item;
+		if (*item == '\0' || strlen(item) >= HTTP_DNS_HOST_LEN)
+			goto bad_item;
+
+		if (*nlimits == size)
+		{
+			size *= 2;
+			*limits = repalloc(*limits, size * sizeof(http_rate_limit));
+		}
+		limit = &((*limits)[(*nlimits)++]);
+		lower = http_strtolower(item);
+		memset(limit->host, 0, HTTP_DNS_HOST_LEN);
+		strlcpy(limit->host, lower, HTTP_DNS_HOST_LEN);
+		pfree(lower);
+		limit->rate = rate / period;
+		limit->burst = Max(rate, 1);
+		continue;
+
+bad_item:
+		*bad = pstrdup(item);
+		pfree(copy);
+		return false;
+	}
+
+	pfree(copy);
+	return true;
+}
+
+static bool
+http_rate_limits_check(char **newval, void **extra, GucSource source)
+{
+	http_rate_limit *limits;
+	int nlimits;
+	char *bad = NULL;
+
+	if (!http_rate_limits_parse(*newval, &limits, &nlimits, &bad))
+	{
+		GUC_check_errdetail("Invalid rate limit \"%s\", expected host=N/s, host=N/min or host=N/h.", bad);
+		return false;
+	}
+	pfree(limits);
+	return true;
+}
+
+/* Find the limit for a host, parsing the setting again if it has changed */
+static http_rate_limit *
+http_rate_limit_lookup(const char *host)
+{
+	int i;
+
+	if (!http_rate_limits || !http_rate_limits[0])
+		return NULL;
+
+	if (!g_rate_limits_parsed || strcmp(g_rate_limits_parsed, http_rate_limits) != 0)
+	{
+		MemoryContext oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+		char *bad = NULL;
+
+		if (g_rate_limits_parsed)
+			pfree(g_rate_limits_parsed);
+		if (g_rate_limits)
+			pfree(g_rate_limits);
+		g_rate_limits_parsed = pstrdup(http_rate_limits);
+		if (!http_rate_limits_parse(http_rate_limits, &g_rate_limits, &g_rate_limits_count, &bad))
+			g_rate_limits_count = 0;
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	for (i = 0; i < g_rate_limits_count; i++)
+	{
+		if (strcmp(g_rate_limits[i].host, host) == 0)
+			return &(g_rate_limits[i]);
+	}
+	return NULL;
+}
+
+/*
+* Take a token from the host's bucket, returning zero, or if
+* there is none, the time in milliseconds until there will be.
+*/
+static long
+http_rate_limit_take(const http_rate_limit *limit)
+{
+	http_rate_bucket *bucket;
+	TimestampTz now = GetCurrentTimestamp();
+	long wait_ms = 0;
+	bool found;
+
+	if (!g_rate_buckets)
+	{
+		HASHCTL info;
+		memset(&info, 0, sizeof(info));
+		info.keysize = HTTP_DNS_HOST_LEN;
+		info.entrysize = sizeof(http_rate_bucket);
+		g_rate_buckets = hash_create("pgsql-http rate limits", 16, &info, HASH_ELEM | HASH_BLOBS);
+	}
+
+	if (g_rate_lock)
+		LWLockAcquire(g_rate_lock, LW_EXCLUSIVE);
+
+	bucket = hash_search(g_rate_buckets, limit->host, HASH_ENTER_NULL, &found);
+	if (bucket)
+	{
+		if (!found)
+			bucket->tokens = limit->burst;
+		else
+		{
+			double elapsed = (double) (now - bucket->updated) / USECS_PER_SEC;
+			bucket->tokens = Min(limit->burst, bucket->tokens + Max(elapsed, 0) * limit->rate);
+		}
+		bucket->updated = now;
+
+		if (bucket->tokens >= 1)
+			bucket->tokens -= 1;
+		else
+			wait_ms = (long) ((1 - bucket->tokens) / limit->rate * 1000) + 1;
+	}
+
+	if (g_rate_lock)
+		LWLockRelease(g_rate_lock);
+
+	/* With no room to track the host, it goes unlimited */
+	return wait_ms;
+}
+
+/*
+* Take a token for the transfer's host, returning zero, or if
+* there is none, the time in milliseconds until there will be.
+* A transfer that has already waited waited_ms, and would have
+* to wait longer than http.rate_limit_wait in all, is marked to
+* fail instead.
+*/
+static long
+http_rate_limit_try(http_transfer *xfer, long waited_ms)
+{
+	http_rate_limit *limit;
+	long wait_ms;
+
+	if (xfer->fail_fast != CURLE_OK || !http_rate_limits || !http_rate_limits[0] || !xfer->host)
+		return 0;
+	if (!(limit = http_rate_limit_lookup(xfer->host)))
+		return 0;
+
+	wait_ms = http_rate_limit_take(limit);
+	if (wait_ms > 0 && waited_ms + wait_ms > http_rate_limit_max_wait)
+	{
+		xfer->fail_fast = CURLE_OPERATION_TIMEDOUT;
+		snprintf(xfer->error_buffer, CURL_ERROR_SIZE,
+		         "Rate limit for host %s exceeded", limit->host);
+		return 0;
+	}
+	return wait_ms;
+}
+
+/*
+* Hold the transfer until its host's rate limit allows it,
+* or mark it to fail if that would take too long.
+*/
+static void
+http_rate_limit_wait(http_transfer *xfer)
+{
+	long waited = 0;
+
+	for (;;)
+	{
+		long wait_ms = http_rate_limit_try(xfer, waited);
+
+		if (wait_ms == 0)
+			return;
+
+		(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+		                 wait_ms, wait_event_rate_limit);
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
+		waited += wait_ms;
+	}
+}
+
+static void
+http_rate_guc_init(void)
+{
+	DefineCustomStringVariable(
+		"http.rate_limits",
+		"Request rate limits for hosts.",
+		"A list like 'api.example.com=50/s, example.org=600/min'.",
+		&http_rate_limits,
+		"",
+		PGC_SIGHUP,
+		0, http_rate_limits_check, NULL, NULL);
+
+	DefineCustomIntVariable(
+		"http.rate_limit_wait",
+		"Longest time a request waits for its host's rate limit.",
+		"A request that would wait longer fails instead. Zero fails at once.",
+		&http_rate_limit_max_wait,
+		10000, 0, INT_MAX,
+		PGC_USERSET,
+		GUC_UNIT_MS, NULL, NULL, NULL);
+}
+
+/*************************************************************************
+* Per-host circuit breakers
+*
+* With http.circuit_failure_threshold set, a host that fails
+* that many requests in a row (transport errors, or statuses of
+* 500 and up) has its circuit opened, and requests to it fail at
+* once rather than wait out their timeouts. After
+* http.circuit_reset_timeout one request is let through as a
+* probe, and its outcome closes or reopens the circuit. Like the
+* rate limit buckets, the circuits are in shared memory when the
+* library is preloaded, and per backend otherwise.
+*************************************************************************/
+
+#define HTTP_CIRCUIT_HOSTS 256
+
+typedef enum {
+	HTTP_CIRCUIT_CLOSED,
+	HTTP_CIRCUIT_OPEN,
+	HTTP_CIRCUIT_HALF_OPEN
+} http_circuit_status;
+
+typedef struct {
+	char host[HTTP_DNS_HOST_LEN];
+	http_circuit_status status;
+	int failures;        /* in a row */
+	TimestampTz opened;
+	TimestampTz probe;   /* when the probe was let through, 0 if none */
+} http_circuit;
+
+/* Options that change when a request is given up on */
+static const CURLoption http_circuit_timeout_curlopts[] = {
+	CURLOPT_TIMEOUT,
+	CURLOPT_TIMEOUT_MS,
+	CURLOPT_CONNECTTIMEOUT,
+	CURLOPT_CONNECTTIMEOUT_MS,
+	0
+};
+
+/* Circuit breaker GUC variables */
+static int http_circuit_failure_threshold = 0;
+static int http_circuit_reset_timeout = 30000;
+static int http_circuit_fallback_status = 0;
+
+/* Circuits that are not closed, shared when possible */
+static HTAB *g_circuits = NULL;
+static LWLock *g_circuit_lock = NULL;
+
+static Size
+http_circuit_shmem_size(void)
+{
+	return hash_estimate_size(HTTP_CIRCUIT_HOSTS, sizeof(http_circuit));
+}
+
+static void
+http_circuit_shmem_request(void)
+{
+	RequestNamedLWLockTranche("pgsql-http circuits", 1);
+}
+
+static void
+http_circuit_shmem_startup(void)
+{
+	HASHCTL info;
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = HTTP_DNS_HOST_LEN;
+	info.entrysize = sizeof(http_circuit);
+	g_circuits = ShmemInitHash("pgsql-http circuits",
+	                           HTTP_CIRCUIT_HOSTS, HTTP_CIRCUIT_HOSTS,
+	                           &info, HASH_ELEM | HASH_BLOBS | HASH_FIXED_SIZE);
+	g_circuit_lock = &(GetNamedLWLockTranche("pgsql-http circuits")->lock);
+}
+
+static HTAB *
+http_circuit_table(void)
+{
+	if (!g_circuits)
+	{
+		HASHCTL info;
+		memset(&info, 0, sizeof(info));
+		info.keysize = HTTP_DNS_HOST_LEN;
+		info.entrysize = sizeof(http_circuit);
+		g_circuits = hash_create("pgsql-http circuits", 16, &info, HASH_ELEM | HASH_BLOBS);
+	}
+	return g_circuits;
+}
+
+static void
+http_circuit_key(const char *host, char *key)
+{
+	memset(key, 0, HTTP_DNS_HOST_LEN);
+	strlcpy(key, host, HTTP_DNS_HOST_LEN);
+}
+
+/*
+* Make room for another host in a full table by dropping
+* the closed circuit with the fewest failures. Open circuits
+* are kept, so with no closed one there is no room.
+*/
+static bool
+http_circuit_make_room(HTAB *table)
+{
+	HASH_SEQ_STATUS status;
+	http_circuit *circuit;
+	http_circuit *fewest = NULL;
+
+	hash_seq_init(&status, table);
+	while ((circuit = hash_seq_search(&status)) != NULL)
+	{
+		if (circuit->status == HTTP_CIRCUIT_CLOSED &&
+		    (!fewest || circuit->failures < fewest->failures))
+			fewest = circuit;
+	}
+	if (!fewest)
+		return false;
+	hash_search(table, fewest->host, HASH_REMOVE, NULL);
+	return true;
+}
+
+/*
+* Decide whether a request to the host may run. While the
+* circuit is open only a probe, once the reset timeout has
+* passed, is let through.
+*/
+static bool
+http_circuit_admit(const char *host)
+{
+	char key[HTTP_DNS_HOST_LEN];
+	http_circuit *circuit;
+	bool admit = true;
+
+	http_circuit_key(host, key);
+	if (g_circuit_lock)
+		LWLockAcquire(g_circuit_lock, LW_EXCLUSIVE);
+
+	circuit = hash_search(http_circuit_table(), key, HASH_FIND, NULL);
+	if (circuit && circuit->status != HTTP_CIRCUIT_CLOSED)
+	{
+		TimestampTz now = GetCurrentTimestamp();
+
+		if (circuit->status == HTTP_CIRCUIT_OPEN &&
+		    now >= TimestampTzPlusMilliseconds(circuit->opened, http_circuit_reset_timeout))
+		{
+			circuit->status = HTTP_CIRCUIT_HALF_OPEN;
+			circuit->probe = now;
+		}
+		else if (circuit->status == HTTP_CIRCUIT_HALF_OPEN &&
+		         (circuit->probe == 0 ||
+		          now >= TimestampTzPlusMilliseconds(circuit->probe, http_circuit_reset_timeout)))
+		{
+			/* The last probe never reported back */
+			circuit->probe = now;
+		}
+		else
+			admit = false;
+	}
+
+	if (g_circuit_lock)
+		LWLockRelease(g_circuit_lock);
+	return admit;
+}
+
+/*
+* Count the outcome of an admitted transfer against its host.
+* Transfers that never ran leave the count alone, but give up
+* their place as the probe.
+*/
+static void
+http_circuit_note(http_transfer *xfer, CURLcode result)
+{
+	char key[HTTP_DNS_HOST_LEN];
+	HTAB *table;
+	HASHACTION action;
+	http_circuit *circuit;
+	int outcome; /* 1 success, 0 unknown, -1 failure */
+	bool found;
+
+	if (!xfer->circuit)
+		return;
+	xfer->circuit = false;
+
+	if (xfer->fail_fast != CURLE_OK || result == CURLE_ABORTED_BY_CALLBACK)
+		outcome = 0;
+	else if (result == CURLE_OK || result == CURLE_HTTP_RETURNED_ERROR)
+	{
+		long status = 0;
+		curl_easy_getinfo(xfer->handle, CURLINFO_RESPONSE_CODE, &status);
+		outcome = status >= 500 ? -1 : 1;
+	}
+	else
+		outcome = -1;
+
+	/*
+	* The circuits are shared, so a session that gives up sooner,
+	* or goes another way, than configured has no say in them.
+	*/
+	if (curlopts_are_changed(http_circuit_timeout_curlopts) ||
+	    curlopts_are_changed(http_dns_route_curlopts))
+		outcome = 0;
+
+	if (!xfer->host)
+		return;
+	http_circuit_key(xfer->host, key);
+
+	if (g_circuit_lock)
+		LWLockAcquire(g_circuit_lock, LW_EXCLUSIVE);
+
+	/* A failure of a new host is only counted if there is room for it */
+	table = http_circuit_table();
+	action = outcome < 0 ? HASH_ENTER_NULL : HASH_FIND;
+	if (action == HASH_ENTER_NULL && hash_get_num_entries(table) >= HTTP_CIRCUIT_HOSTS &&
+	    !hash_search(table, key, HASH_FIND, NULL) && !http_circuit_make_room(table))
+		action = HASH_FIND;
+
+	circuit = hash_search(table, key, action, &found);
+	if (circuit)
+	{
+		if (outcome > 0)
+			hash_search(table, key, HASH_REMOVE, NULL);
+		else if (outcome == 0)
+		{
+			if (circuit->status == HTTP_CIRCUIT_HALF_OPEN)
+				circuit->probe = 0;
+		}
+		else
+		{
+			if (!found)
+			{
+				circuit->status = HTTP_CIRCUIT_CLOSED;
+				circuit->failures = 0;
+				circuit->opened = circuit->probe = 0;
+			}
+			circuit->failures++;
+			if (circuit->status == HTTP_CIRCUIT_HALF_OPEN ||
+			    (circuit->status == HTTP_CIRCUIT_CLOSED &&
+			     circuit->failures >= http_circuit_failure_threshold))
+			{
+				circuit->status = HTTP_CIRCUIT_OPEN;
+				circuit->opened = GetCurrentTimestamp();
+				circuit->probe = 0;
+			}
+		}
+	}
+
+	if (g_circuit_lock)
+		LWLockRelease(g_circuit_lock);
+}
+
+/**
+* List the circuits that are not closed, or are counting
+* failures towards opening.
+*/
+Datum http_circuit_entries(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(http_circuit_entries);
+Datum http_circuit_entries(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext oldcontext;
+	Tuplestorestate *tupstore;
+	TupleDesc tupdesc;
+	HASH_SEQ_STATUS status;
+	http_circuit *circuit;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+		!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("%s called with incompatible return type", __func__)));
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupdesc = CreateTupleDescCopy(tupdesc);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	if (g_circuit_lock)
+		LWLockAcquire(g_circuit_lock, LW_SHARED);
+	hash_seq_init(&status, http_circuit_table());
+	while ((circuit = hash_seq_search(&status)) != NULL)
+	{
+		static const char *names[] = {"closed", "open", "half-open"};
+		Datum values[4];
+		bool nulls[4] = {false, false, false, false};
+
+		values[0] = CStringGetTextDatum(circuit->host);
+		values[1] = CStringGetTextDatum(names[circuit->status]);
+		values[2] = Int32GetDatum(circuit->failures);
+		if (circuit->status != HTTP_CIRCUIT_CLOSED)
+			values[3] = TimestampTzGetDatum(circuit->opened);
+		else
+			nulls[3] = true;
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+	if (g_circuit_lock)
+		LWLockRelease(g_circuit_lock);
+
+	return (Datum) 0;
+}
+
+/**
+* Close the circuit for a host, or all of them.
+*/
+Datum http_circuit_reset(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(http_circuit_reset);
+Datum http_circuit_reset(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS status;
+	http_circuit *circuit;
+
+	if (g_circuit_lock)
+		LWLockAcquire(g_circuit_lock, LW_EXCLUSIVE);
+	if (PG_ARGISNULL(0))
+	{
+		hash_seq_init(&status, http_circuit_table());
+		while ((circuit = hash_seq_search(&status)) != NULL)
+			hash_search(http_circuit_table(), circuit->host, HASH_REMOVE, NULL);
+	}
+	else
+	{
+		char key[HTTP_DNS_HOST_LEN];
+		char *host = http_strtolower(text_to_cstring(PG_GETARG_TEXT_PP(0)));
+		http_circuit_key(host, key);
+		hash_search(http_circuit_table(), key, HASH_REMOVE, NULL);
+	}
+	if (g_circuit_lock)
+		LWLockRelease(g_circuit_lock);
+
+	PG_RETURN_VOID();
+}
+
+static void
+http_circuit_guc_init(void)
+{
+	DefineCustomIntVariable(
+		"http.circuit_failure_threshold",
+		"Failed requests in a row that open the circuit for a host.",
+		"Zero disables the circuit breakers.",
+		&http_circuit_failure_threshold,
+		0, 0, INT_MAX,
+		PGC_SIGHUP,
+		0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable(
+		"http.circuit_reset_timeout",
+		"Time a circuit stays open before a probe request is let through.",
+		NULL,
+		&http_circuit_reset_timeout,
+		30000, 0, INT_MAX,
+		PGC_SIGHUP,
+		GUC_UNIT_MS, NULL, NULL, NULL);
+
+	DefineCustomIntVariable(
+		"http.circuit_fallback_status",
+		"Status of the empty response returned while a circuit is open.",
+		"Zero raises an error instead.",
+		&http_circuit_fallback_status,
+		0, 0, 599,
+		PGC_USERSET,
+		0, NULL, NULL, NULL);
+}
+
+/*************************************************************************
+* Statistics
+*
+* Each finished transfer is counted against its host: requests,
+* responses by status class, transport errors by curl code,
+* bytes each way and the spread of total times. The counts are
+* in shared memory when the library is preloaded, and per
+* backend otherwise, and are shown by the pg_stat_http view.
+* Counting takes the lock on the table in shared mode, and
+* only the entry's own spinlock, so that backends requesting
+* at once do not queue behind each other; only the first
+* request to a host takes the lock exclusively, to add it.
+*************************************************************************/
+
+#define HTTP_STATS_HOSTS 256
+#define HTTP_STATS_ERRORS 100   /* curl codes past this are counted together */
+#define HTTP_STATS_BUCKETS 7
+
+/* Upper bounds in milliseconds of the latency buckets, the last is open */
+static const int http_stats_bounds[HTTP_STATS_BUCKETS - 1] = {10, 50, 100, 500, 1000, 5000};
+
+typedef struct {
+	char host[HTTP_DNS_HOST_LEN];
+	slock_t mutex;       /* protects the counts */
+	int64 requests;
+	int64 statuses[5];   /* 1xx to 5xx */
+	int64 errors;
+	int64 error_codes[HTTP_STATS_ERRORS];
+	int64 bytes_sent;
+	int64 bytes_received;
+	int64 total_time;    /* microseconds */
+	int64 max_time;
+	int64 latency[HTTP_STATS_BUCKETS];
+	TimestampTz since;
+} http_stats;
+
+/* Statistics GUC variables */
+static bool http_track_stats = true;
+
+/* Host statistics, shared when possible */
+static HTAB *g_stats = NULL;
+static LWLock *g_stats_lock = NULL;
+
+static Size
+http_stats_shmem_size(void)
+{
+	return hash_estimate_size(HTTP_STATS_HOSTS, sizeof(http_stats));
+}
+
+static void
+http_stats_shmem_request(void)
+{
+	RequestNamedLWLockTranche("pgsql-http stats", 1);
+}
+
+static void
+http_stats_shmem_startup(void)
+{
+	HASHCTL info;
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = HTTP_DNS_HOST_LEN;
+	info.entrysize = sizeof(http_stats);
+	g_stats = ShmemInitHash("pgsql-http stats",
+	                        HTTP_STATS_HOSTS, HTTP_STATS_HOSTS,
+	                        &info, HASH_ELEM | HASH_BLOBS | HASH_FIXED_SIZE);
+	g_stats_lock = &(GetNamedLWLockTranche("pgsql-http stats")->lock);
+}
+
+static HTAB *
+http_stats_table(void)
+{
+	if (!g_stats)
+	{
+		HASHCTL info;
+		memset(&info, 0, sizeof(info));
+		info.keysize = HTTP_DNS_HOST_LEN;
+		info.entrysize = sizeof(http_stats);
+		g_stats = hash_create("pgsql-http stats", 16, &info, HASH_ELEM | HASH_BLOBS);
+	}
+	return g_stats;
+}
+
+/*
+* Make room for another host in a full table by dropping the
+* host with the fewest requests. Needs the exclusive lock.
+*/
+static void
+http_stats_make_room(HTAB *table)
+{
+	HASH_SEQ_STATUS status;
+	http_stats *stats;
+	http_stats *fewest = NULL;
+
+	hash_seq_init(&status, table);
+	while ((stats = hash_seq_search(&status)) != NULL)
+	{
+		if (!fewest || stats->requests < fewest->requests)
+			fewest = stats;
+	}
+	if (fewest)
+		hash_search(table, fewest->host, HASH_REMOVE, NULL);
+}
+
+/*
+* Read one of the times of the last transfer on a handle, in
+* microseconds.
+*/
+static int64
+http_transfer_time(CURL *handle, CURLINFO info)
+{
+#if LIBCURL_VERSION_NUM >= 0x073d00 /* 7.61.0 */
+	curl_off_t us = 0;
+	curl_easy_getinfo(handle, info, &us);
+	return (int64) us;
+#else
+	double seconds = 0;
+	curl_easy_getinfo(handle, info, &seconds);
+	return (int64) (seconds * 1000000);
+#endif
+}
+
+/*
+* Read the sizes and total time of the last transfer on a
+* handle, in bytes and microseconds.
+*/
+static void
+http_transfer_metrics(CURL *handle, int64 *sent, int64 *received, int64 *total_time)
+{
+	long request_size = 0, header_size = 0;
+#if LIBCURL_VERSION_NUM >= 0x073700 /* 7.55.0 */
+	curl_off_t upload = 0, download = 0;
+#else
+	double upload = 0, download = 0;
+#endif
+
+#if LIBCURL_VERSION_NUM >= 0x073700 /* 7.55.0 */
+	curl_easy_getinfo(handle, CURLINFO_SIZE_UPLOAD_T, &upload);
+	curl_easy_getinfo(handle, CURLINFO_SIZE_DOWNLOAD_T, &download);
+#else
+	curl_easy_getinfo(handle, CURLINFO_SIZE_UPLOAD, &upload);
+	curl_easy_getinfo(handle, CURLINFO_SIZE_DOWNLOAD, &download);
+#endif
+	curl_easy_getinfo(handle, CURLINFO_REQUEST_SIZE, &request_size);
+	curl_easy_getinfo(handle, CURLINFO_HEADER_SIZE, &header_size);
+	*sent = request_size + (int64) upload;
+	*received = header_size + (int64) download;
+	*total_time = http_transfer_time(handle, HTTP_TIME_INFO(TOTAL));
+}
+
+/*
+* Count a finished transfer against its host. Transfers that
+* never ran count as a request and an error, with nothing more
+* read from the handle, which still holds the last transfer.
+*/
+static void
+http_stats_note(http_transfer *xfer, CURLcode result)
+{
+	char key[HTTP_DNS_HOST_LEN];
+	http_stats *stats;
+	long status = 0;
+	int64 sent = 0, received = 0, total_time = 0;
+	int code = -1;
+	int bucket = 0;
+	bool found;
+
+	if (!http_track_stats || !xfer->host)
+		return;
+	memset(key, 0, sizeof(key));
+	strlcpy(key, xfer->host, sizeof(key));
+
+	/* Work out what to count before taking any lock */
+	if (xfer->fail_fast == CURLE_OK)
+	{
+		if (result == CURLE_OK || result == CURLE_HTTP_RETURNED_ERROR)
+			curl_easy_getinfo(xfer->handle, CURLINFO_RESPONSE_CODE, &status);
+		http_transfer_metrics(xfer->handle, &sent, &received, &total_time);
+		while (bucket < HTTP_STATS_BUCKETS - 1 &&
+		       total_time > http_stats_bounds[bucket] * INT64CONST(1000))
+			bucket++;
+	}
+	if (!(status >= 100 && status < 600) && (result != CURLE_OK || xfer->fail_fast != CURLE_OK))
+		code = Min((int) (xfer->fail_fast != CURLE_OK ? xfer->fail_fast : result), HTTP_STATS_ERRORS - 1);
+
+	if (g_stats_lock)
+		LWLockAcquire(g_stats_lock, LW_SHARED);
+
+	stats = hash_search(http_stats_table(), key, HASH_FIND, NULL);
+	if (!stats)
+	{
+		/* A new host can only be added under the exclusive lock */
+		if (g_stats_lock)
+		{
+			LWLockRelease(g_stats_lock);
+			LWLockAcquire(g_stats_lock, LW_EXCLUSIVE);
+		}
+		if (hash_get_num_entries(http_stats_table()) >= HTTP_STATS_HOSTS &&
+		    !hash_search(http_stats_table(), key, HASH_FIND, NULL))
+			http_stats_make_room(http_stats_table());
+		stats = hash_search(http_stats_table(), key, HASH_ENTER_NULL, &found);
+		if (stats && !found)
+		{
+			memset(((char *) stats) + HTTP_DNS_HOST_LEN, 0, sizeof(http_stats) - HTTP_DNS_HOST_LEN);
+			SpinLockInit(&(stats->mutex));
+			stats->since = GetCurrentTimestamp();
+		}
+	}
+
+	if (stats)
+	{
+		SpinLockAcquire(&(stats->mutex));
+		stats->requests++;
+		if (status >= 100 && status < 600)
+			stats->statuses[status / 100 - 1]++;
+		else if (code >= 0)
+		{
+			stats->errors++;
+			stats->error_codes[code]++;
+		}
+		if (xfer->fail_fast == CURLE_OK)
+		{
+			stats->bytes_sent += sent;
+			stats->bytes_received += received;
+			stats->total_time += total_time;
+			stats->max_time = Max(stats->max_time, total_time);
+			stats->latency[bucket]++;
+		}
+		SpinLockRelease(&(stats->mutex));
+	}
+
+	if (g_stats_lock)
+		LWLockRelease(g_stats_lock);
+}
+
+/**
+* Return the statistics of each host, behind the pg_stat_http view.
+*/
+Datum http_stats_entries(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(http_stats_entries);
+Datum http_stats_entries(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext oldcontext;
+	Tuplestorestate *tupstore;
+	TupleDesc tupdesc;
+	HASH_SEQ_STATUS status;
+	http_stats *entry;
+	http_stats *stats;
+	http_stats copy;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+		!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("%s called with incompatible return type", __func__)));
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupdesc = CreateTupleDescCopy(tupdesc);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	if (g_stats_lock)
+		LWLockAcquire(g_stats_lock, LW_SHARED);
+	hash_seq_init(&status, http_stats_table());
+	while ((entry = hash_seq_search(&status)) != NULL)
+	{
+		Datum values[16];
+		bool nulls[16];
+		Datum latency[HTTP_STATS_BUCKETS];
+		StringInfoData codes;
+		int64 timed = 0;
+		int i;
+
+		/* Take a consistent copy, as other backends may be counting */
+		SpinLockAcquire(&(entry->mutex));
+		memcpy(&copy, entry, sizeof(http_stats));
+		SpinLockRelease(&(entry->mutex));
+		stats = &copy;
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = CStringGetTextDatum(stats->host);
+		values[1] = Int64GetDatum(stats->requests);
+		for (i = 0; i < 5; i++)
+			values[2 + i] = Int64GetDatum(stats->statuses[i]);
+		values[7] = Int64GetDatum(stats->errors);
+
+		/* Error counts as a jsonb object keyed by curl code */
+		initStringInfo(&codes);
+		appendStringInfoChar(&codes, '{');
+		for (i = 0; i < HTTP_STATS_ERRORS; i++)
+		{
+			if (!stats->error_codes[i])
+				continue;
+			appendStringInfo(&codes, "%s\"%d\": " INT64_FORMAT,
+			                 codes.len > 1 ? ", " : "", i, stats->error_codes[i]);
+		}
+		appendStringInfoChar(&codes, '}');
+		values[8] = DirectFunctionCall1(jsonb_in, CStringGetDatum(codes.data));
+
+		values[9] = Int64GetDatum(stats->bytes_sent);
+		values[10] = Int64GetDatum(stats->bytes_received);
+		values[11] = Float8GetDatum(stats->total_time / 1000.0);
+		values[13] = Float8GetDatum(stats->max_time / 1000.0);
+		for (i = 0; i < HTTP_STATS_BUCKETS; i++)
+		{
+			latency[i] = Int64GetDatum(stats->latency[i]);
+			timed += stats->latency[i];
+		}
+		if (timed > 0)
+			values[12] = Float8GetDatum(stats->total_time / 1000.0 / timed);
+		else
+			nulls[12] = true;
+		values[14] = PointerGetDatum(construct_array(latency, HTTP_STATS_BUCKETS, INT8OID,
+		                                             sizeof(int64), FLOAT8PASSBYVAL, 'd'));
+		values[15] = TimestampTzGetDatum(stats->since);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+	if (g_stats_lock)
+		LWLockRelease(g_stats_lock);
+
+	return (Datum) 0;
+}
+
+/**
+* Forget the statistics of a host, or all of them.
+*/
+Datum http_stats_reset(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(http_stats_reset);
+Datum http_stats_reset(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS status;
+	http_stats *stats;
+
+	if (g_stats_lock)
+		LWLockAcquire(g_stats_lock, LW_EXCLUSIVE);
+	if (PG_ARGISNULL(0))
+	{
+		hash_seq_init(&status, http_stats_table());
+		while ((stats = hash_seq_search(&status)) != NULL)
+			hash_search(http_stats_table(), stats->host, HASH_REMOVE, NULL);
+	}
+	else
+	{
+		char key[HTTP_DNS_HOST_LEN];
+		char *host = http_strtolower(text_to_cstring(PG_GETARG_TEXT_PP(0)));
+		memset(key, 0, sizeof(key));
+		strlcpy(key, host, sizeof(key));
+		hash_search(http_stats_table(), key, HASH_REMOVE, NULL);
+	}
+	if (g_stats_lock)
+		LWLockRelease(g_stats_lock);
+
+	PG_RETURN_VOID();
+}
+
+static void
+http_stats_guc_init(void)
+{
+	DefineCustomBoolVariable(
+		"http.track_stats",
+		"Collects statistics on the requests made to each host.",
+		NULL,
+		&http_track_stats,
+		true,
+		PGC_SUSET,
+		0, NULL, NULL, NULL);
+}
+
+/*************************************************************************
+* Timing
+*
+* The phases of the last transfer the backend made, for telling
+* a slow name lookup from a slow handshake or a slow server.
+*************************************************************************/
+
+typedef struct {
+	char *uri;
+	int64 namelookup;     /* microseconds from the start of the transfer */
+	int64 connect;
+	int64 appconnect;
+	int64 pretransfer;
+	int64 starttransfer;
+	int64 total;
+	int64 redirect;
+	long redirect_count;
+	int64 bytes_sent;
+	int64 bytes_received;
+	bool reused;
+	long http_version;
+} http_timing;
+
+static http_timing g_last_timing;
+static bool g_last_timing_set = false;
+
+/*
+* Keep the timing of a transfer that ran, as the backend's last.
+*/
+static void
+http_timing_note(http_transfer *xfer)
+{
+	http_timing *t = &g_last_timing;
+	long num_connects = 0;
+
+	if (xfer->fail_fast != CURLE_OK)
+		return;
+
+	if (t->uri)
+		pfree(t->uri);
+	t->uri = MemoryContextStrdup(TopMemoryContext, xfer->uri);
+	t->namelookup = http_transfer_time(xfer->handle, HTTP_TIME_INFO(NAMELOOKUP));
+	t->connect = http_transfer_time(xfer->handle, HTTP_TIME_INFO(CONNECT));
+	t->appconnect = http_transfer_time(xfer->handle, HTTP_TIME_INFO(APPCONNECT));
+	t->pretransfer = http_transfer_time(xfer->handle, HTTP_TIME_INFO(PRETRANSFER));
+	t->starttransfer = http_transfer_time(xfer->handle, HTTP_TIME_INFO(STARTTRANSFER));
+	t->redirect = http_transfer_time(xfer->handle, HTTP_TIME_INFO(REDIRECT));
+	t->redirect_count = 0;
+	curl_easy_getinfo(xfer->handle, CURLINFO_REDIRECT_COUNT, &(t->redirect_count));
+	http_transfer_metrics(xfer->handle, &(t->bytes_sent), &(t->bytes_received), &(t->total));
+	curl_easy_getinfo(xfer->handle, CURLINFO_NUM_CONNECTS, &num_connects);
+	t->reused = num_connects == 0;
+	t->http_version = 0;
+#if LIBCURL_VERSION_NUM >= 0x073200 /* 7.50.0 */
+	curl_easy_getinfo(xfer->handle, CURLINFO_HTTP_VERSION, &(t->http_version));
+#endif
+	g_last_timing_set = true;
+}
+
+/**
+* Return the timing of the last transfer this backend made,
+* with times in milliseconds.
+*/
+Datum http_last_timing(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(http_last_timing);
+Datum http_last_timing(PG_FUNCTION_ARGS)
+{
+	http_timing *t = &g_last_timing;
+	TupleDesc tupdesc;
+	Datum values[13];
+	bool nulls[13];
+	const char *version = NULL;
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("%s called with incompatible return type", __func__)));
+
+	if (!g_last_timing_set)
+		PG_RETURN_NULL();
+
+	switch (t->http_version)
+	{
+#if LIBCURL_VERSION_NUM >= 0x073200 /* 7.50.0 */
+		case CURL_HTTP_VERSION_1_0: version = "1.0"; break;
+		case CURL_HTTP_VERSION_1_1: version = "1.1"; break;
+		case CURL_HTTP_VERSION_2_0: version = "2"; break;
+#endif
+#if LIBCURL_VERSION_NUM >= 0x074200 /* 7.66.0 */
+		case CURL_HTTP_VERSION_3: version = "3"; break;
+#endif
+		default: break;
+	}
+
+	memset(nulls, 0, sizeof(nulls));
+	values[0] = CStringGetTextDatum(t->uri);
+	values[1] = Float8GetDatum(t->namelookup / 1000.0);
+	values[2] = Float8GetDatum(t->connect / 1000.0);
+	values[3] = Float8GetDatum(t->appconnect / 1000.0);
+	values[4] = Float8GetDatum(t->pretransfer / 1000.0);
+	values[5] = Float8GetDatum(t->starttransfer / 1000.0);
+	values[6] = Float8GetDatum(t->total / 1000.0);
+	values[7] = Float8GetDatum(t->redirect / 1000.0);
+	values[8] = Int32GetDatum((int32) t->redirect_count);
+	values[9] = Int64GetDatum(t->bytes_sent);
+	values[10] = Int64GetDatum(t->bytes_received);
+	values[11] = BoolGetDatum(t->reused);
+	if (version)
+		values[12] = CStringGetTextDatum(version);
+	else
+		nulls[12] = true;
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc), values, nulls)));
+}
+
+/*
+* Mark a transfer to fail if its host's circuit is open.
+*/
+static void
+http_transfer_admit_circuit(http_transfer *xfer)
+{
+	if (xfer->fail_fast != CURLE_OK || http_circuit_failure_threshold <= 0 || !xfer->host)
+		return;
+
+	if (!http_circuit_admit(xfer->host))
+	{
+		xfer->fail_fast = CURLE_COULDNT_CONNECT;
+		xfer->fallback_status = http_circuit_fallback_status;
+		snprintf(xfer->error_buffer, CURL_ERROR_SIZE, "Circuit open for host %s", xfer->host);
+		return;
+	}
+	xfer->circuit = true;
+}
+
+/*
+* Decide whether a transfer that is set up may run now: its
+* host's circuit must admit it, and then its rate limit.
+*/
+static void
+http_transfer_admit(http_transfer *xfer)
+{
+	http_transfer_admit_circuit(xfer);
+	http_rate_limit_wait(xfer);
+}
+
+/*
+* Like http_transfer_admit(), but without waiting on the rate
+* limit, for callers driving other transfers meanwhile. Returns
+* true if the transfer may run now, or is marked to fail, and
+* false if it is held back, to be offered again once admit_at
+* has passed.
+*/
+static bool
+http_transfer_admit_nowait(http_transfer *xfer)
+{
+	TimestampTz now = GetCurrentTimestamp();
+	long waited_ms = 0;
+	long wait_ms;
+
+	if (!xfer->deferred)
+		http_transfer_admit_circuit(xfer);
+	else
+		waited_ms = (long) ((now - xfer->deferred) / 1000);
+
+	wait_ms = http_rate_limit_try(xfer, waited_ms);
+	if (wait_ms == 0)
+	{
+		xfer->deferred = 0;
+		return true;
+	}
+
+	if (!xfer->deferred)
+		xfer->deferred = now;
+	xfer->admit_at = TimestampTzPlusMilliseconds(now, wait_ms);
+	return false;
+}
+
+/*
+* The time in milliseconds, up to timeout_ms, until a held
+* back transfer is to be offered to its rate limit again.
+*/
+static long
+http_transfer_admit_timeout(http_transfer *xfer, long timeout_ms)
+{
+	long wait_ms;
+
+	if (!xfer->handle || !xfer->deferred)
+		return timeout_ms;
+	wait_ms = (long) ((xfer->admit_at - GetCurrentTimestamp()) / 1000);
+	return Max(0, Min(timeout_ms, wait_ms));
+}
+
+/*
+* Learn what we can from a finished (or never started)
+* transfer, for the DNS cache, the circuit breakers, the
+* statistics and http_last_timing(). The body is put back
+* together here too, if it was spilled to a file, a failure to
+* write that file is raised, and a transfer stopped for its
+* size is given an error that says so.
+*/
+static void
+http_transfer_done(http_transfer *xfer, CURLcode result)
+{
+	if (xfer->too_large || result == CURLE_FILESIZE_EXCEEDED)
+		snprintf(xfer->error_buffer, CURL_ERROR_SIZE,
+		         "Response from %s is larger than http.max_response_bytes (%d bytes)",
+		         xfer->uri, http_max_response_bytes);
+	if (xfer->spill_scope && xfer->spill_scope->lost)
+		xfer->spill = NULL;
+	if (xfer->spill)
+	{
+		if (result == CURLE_OK)
+			http_transfer_body_unspill(xfer);
+		else
+		{
+			BufFileClose(xfer->spill);
+			xfer->spill = NULL;
+		}
+	}
+	if (xfer->spill_scope && xfer->spill_scope->error)
+		ReThrowError(xfer->spill_scope->error);
+
+	http_dns_cache_note(xfer, result);
+	http_circuit_note(xfer, result);
+	http_stats_note(xfer, result);
+	http_timing_note(xfer);
+}
+
+/*************************************************************************
+* Retries
+*
+* Requests that can safely be repeated (GET, HEAD, PUT and
+* DELETE) are tried again after connection failures, timeouts,
+* and 429 or 5xx responses, on the same handle and header list.
+* The pause doubles with each try, from http.retry_initial_delay
+* up to http.retry_max_delay, with jitter so that many backends
+* do not retry in step, and a Retry-After from the server is
+* honoured.
+*************************************************************************/
+
+/* Retry GUC variables */
+static int http_max_retries = 0;
+static int http_retry_initial_delay = 100;
+static int http_retry_max_delay = 10000;
+
+/*
+* Milliseconds to wait before trying the transfer again, or
+* -1 if it should not be tried again.
+*/
+static long
+http_retry_delay(http_transfer *xfer, CURLcode result, int attempt)
+{
+	long status = 0;
+	long delay;
+	char *retry_after;
+	int i;
+
+	if (xfer->fail_fast != CURLE_OK)
+		return -1;
+	if (xfer->method != HTTP_GET && xfer->method != HTTP_HEAD &&
+	    xfer->method != HTTP_PUT && xfer->method != HTTP_DELETE)
+		return -1;
+
+	switch (result)
+	{
+		case CURLE_OK:
+			curl_easy_getinfo(xfer->handle, CURLINFO_RESPONSE_CODE, &status);
+			if (status != 429 && (status < 500 || status == 501 || status == 505))
+				return -1;
+			break;
+		case CURLE_COULDNT_RESOLVE_HOST:
+		case CURLE_COULDNT_CONNECT:
+		case CURLE_OPERATION_TIMEDOUT:
+		case CURLE_SEND_ERROR:
+		case CURLE_RECV_ERROR:
+		case CURLE_GOT_NOTHING:
+		case CURLE_PARTIAL_FILE:
+			break;
+		default:
+			return -1;
+	}
+
+	/* Exponential, with the later half jittered */
+	delay = http_retry_initial_delay;
+	for (i = 0; i < attempt && delay < http_retry_max_delay; i++)
+		delay *= 2;
+	delay = Min(delay, http_retry_max_delay);
+#if PG_VERSION_NUM >= 150000
+	delay = delay / 2 + (long) (pg_prng_double(&pg_global_prng_state) * (delay / 2 + 1));
+#else
+	delay = delay / 2 + (long) (((double) random() / ((double) MAX_RANDOM_VALUE + 1)) * (delay / 2 + 1));
+#endif
+
+	/* The server may say how long to stay away, in seconds or as a date */
+	if (status && (retry_after = http_response_header(&(xfer->si_headers), "Retry-After")) != NULL)
+	{
+		long after;
+
+		if (isdigit((unsigned char) retry_after[0]))
+		{
+			long seconds = strtol(retry_after, NULL, 10);
+			after = seconds > http_retry_max_delay / 1000 ? LONG_MAX : seconds * 1000;
+		}
+		else
+		{
+			time_t when = curl_getdate(retry_after, NULL);
+			after = when < 0 ? 0 : ((long) (when - time(NULL))) * 1000;
+		}
+
+		/* Coming back any sooner would be pointless */
+		if (after > http_retry_max_delay)
+			return -1;
+		delay = Max(delay, after);
+	}
+
+	return delay;
+}
+
+/* Pause before a retry, waking early for a cancel */
+static void
+http_retry_wait(long delay_ms)
+{
+	(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+	                 delay_ms, wait_event_retry);
+	ResetLatch(MyLatch);
+	CHECK_FOR_INTERRUPTS();
+}
+
+/* Put the transfer back as it was before it ran */
+static void
+http_transfer_rewind(http_transfer *xfer)
+{
+	resetStringInfo(&(xfer->si_data));
+	if (xfer->binary)
+		appendStringInfoSpaces(&(xfer->si_data), VARHDRSZ);
+	resetStringInfo(&(xfer->si_headers));
+	memset(xfer->error_buffer, 0, sizeof(xfer->error_buffer));
+	xfer->body_pos = 0;
+	xfer->received = 0;
+	xfer->too_large = false;
+}
+
+static void
+http_response_guc_init(void)
+{
+	DefineCustomIntVariable(
+		"http.max_response_bytes",
+		"Largest response body to accept, larger ones fail as soon as seen.",
+		"Zero sets no limit.",
+		&http_max_response_bytes,
+		0, 0, INT_MAX,
+		PGC_USERSET,
+		GUC_UNIT_BYTE, NULL, NULL, NULL);
+
+	DefineCustomIntVariable(
+		"http.spill_threshold",
+		"Response body size past which the body is kept in a temporary file while it arrives.",
+		"Zero keeps bodies in memory.",
+		&http_spill_threshold,
+		0, 0, MAX_KILOBYTES,
+		PGC_USERSET,
+		GUC_UNIT_KB, NULL, NULL, NULL);
+}
+
+static void
+http_retry_guc_init(void)
+{
+	DefineCustomIntVariable(
+		"http.max_retries",
+		"Times a failed request that can be repeated is tried again.",
+		NULL,
+		&http_max_retries,
+		0, 0, 100,
+		PGC_USERSET,
+		0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable(
+		"http.retry_initial_delay",
+		"Pause before the first retry of a request, doubled for each later one.",
+		NULL,
+		&http_retry_initial_delay,
+		100, 0, INT_MAX,
+		PGC_USERSET,
+		GUC_UNIT_MS, NULL, NULL, NULL);
+
+	DefineCustomIntVariable(
+		"http.retry_max_delay",
+		"Longest pause between retries of a request.",
+		"A server asking for a longer pause with Retry-After is not retried.",
+		&http_retry_max_delay,
+		10000, 0, INT_MAX,
+		PGC_USERSET,
+		GUC_UNIT_MS, NULL, NULL, NULL);
+}
+
+/**
+* Read the metadata of a completed transfer from its handle
+* and build the http_response tuple.
+*/
+static HeapTuple
+http_transfer_response(http_transfer *xfer, TupleDesc tup_desc)
+{
+	long long_status;
+	char *content_type = NULL;
+
+	/* Read the metadata from the handle directly */
+	if ( (CURLE_OK != curl_easy_getinfo(xfer->handle, CURLINFO_RESPONSE_CODE, &long_status)) ||
+		 (CURLE_OK != curl_easy_getinfo(xfer->handle, CURLINFO_CONTENT_TYPE, &content_type)) )
+	{
+		ereport(ERROR, (errmsg("CURL: Error in curl_easy_getinfo")));
+	}
+
+	return http_response_form_tuple(tup_desc, long_status, content_type, &(xfer->si_headers), &(xfer->si_data));
+}
+
+/**
+* Master HTTP request function, takes in an http_request tuple and outputs
+* an http_response tuple.
+*/
+Datum http_request(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(http_request);
+Datum http_request(PG_FUNCTION_ARGS)
+{
+	/* Input */
+	HeapTupleHeader rec;
+
+	/* Processing */
+	http_transfer xfer;
+	http_spill_scope spill;
+	int http_return;
+	long long_status;
+	char *content_type = NULL;
+	TupleDesc tup_desc;
+	int attempt;
+	int max_retries = http_max_retries;
+
+	/* Output */
+	HeapTuple tuple_out;
+
+	/* Version check */
+	http_check_curl_version(curl_version_info(CURLVERSION_NOW));
+
+	/* We cannot handle a null request */
+	if ( ! PG_ARGISNULL(0) )
+		rec = PG_GETARG_HEAPTUPLEHEADER(0);
+	else
+	{
+		elog(ERROR, "An http_request must be provided");
+		PG_RETURN_NULL();
+	}
+
+	/* Per-call retry count, overriding http.max_retries */
+	if ( PG_NARGS() > 1 && ! PG_ARGISNULL(1) )
+		max_retries = Max(PG_GETARG_INT32(1), 0);
+
+	/*************************************************************************
+	* Build and run a curl request from the http_request argument
+	*************************************************************************/
+
+	/* Prepare our return object, http_response or http_response_bytea */
+	tup_desc = http_call_result_tupdesc(fcinfo);
+
+	/* Set up global HTTP handle */
+	memset(&xfer, 0, sizeof(xfer));
+	xfer.handle = g_http_handle = http_get_handle();
+	xfer.binary = http_response_is_binary(tup_desc);
+	http_transfer_setup(&xfer, rec);
+
+	/* A fresh cached response saves the trip */
+	if ( http_cache_lookup(&xfer, tup_desc, &tuple_out) )
+	{
+		http_transfer_cleanup(&xfer);
+		PG_RETURN_DATUM(HeapTupleGetDatum(tuple_out));
+	}
+
+	/*************************************************************************
+	* PERFORM THE REQUEST!
+	**************************************************************************/
+	for ( attempt = 0; ; attempt++ )
+	{
+		long delay_ms;
+
+		/* Keep to the host's circuit breaker and rate limit */
+		http_transfer_admit(&xfer);
+		if ( xfer.fallback_status )
+		{
+			http_transfer_done(&xfer, xfer.fail_fast);
+			tuple_out = http_response_form_tuple(tup_desc, xfer.fallback_status, NULL, &(xfer.si_headers), &(xfer.si_data));
+			http_transfer_cleanup(&xfer);
+			PG_RETURN_DATUM(HeapTupleGetDatum(tuple_out));
+		}
+
+#if PG_VERSION_NUM >= 170000
+		/* Set up wait event tracking */
+		http_transfer_wait_start();
+#endif
+
+		if ( xfer.fail_fast != CURLE_OK )
+			http_return = xfer.fail_fast;
+		else
+		{
+			xfer.spill_scope = &spill;
+			http_spill_begin(&spill);
+			http_return = curl_easy_perform(g_http_handle);
+			http_spill_end(&spill);
+		}
+
+#if PG_VERSION_NUM >= 170000
+		http_transfer_wait_end();
+#endif
+
+		http_transfer_done(&xfer, http_return);
+
+		elog(DEBUG2, "pgsql-http: queried '%s'", xfer.uri);
+		elog(DEBUG2, "pgsql-http: http_return '%d'", http_return);
+
+		/* Try again on the same handle, if the failure may pass */
+		if ( attempt >= max_retries || (delay_ms = http_retry_delay(&xfer, http_return, attempt)) < 0 )
+			break;
+
+		elog(DEBUG1, "pgsql-http: retrying '%s' in %ld ms", xfer.uri, delay_ms);
+		http_retry_wait(delay_ms);
+		http_transfer_rewind(&xfer);
+	}
+
+	/*************************************************************************
+	* Create an http_response object from the curl results
+	*************************************************************************/
+
+	/* Write out an error on failure */
+	if ( http_return != CURLE_OK )
+	{
+		http_transfer_cleanup(&xfer);
+		curl_easy_cleanup(g_http_handle);
+		g_http_handle = NULL;
+
+#if LIBCURL_VERSION_NUM >= 0x072700 /* 7.39.0 */
+		/*
+		* If the request was aborted by an interrupt request
+		* report back.
+		*/
+		if (http_return == CURLE_ABORTED_BY_CALLBACK)
+			elog(ERROR, "canceling statement due to user request");
+#endif
+
+		http_error(http_return, xfer.error_buffer);
+	}
+
+	/* Read the metadata from the handle directly */
+	if ( (CURLE_OK != curl_easy_getinfo(g_http_handle, CURLINFO_RESPONSE_CODE, &long_status)) ||
+		 (CURLE_OK != curl_easy_getinfo(g_http_handle, CURLINFO_CONTENT_TYPE, &content_type)) )
+	{
+		http_transfer_cleanup(&xfer);
+		curl_easy_cleanup(g_http_handle);
+		g_http_handle = NULL;
+		ereport(ERROR, (errmsg("CURL: Error in curl_easy_getinfo")));
+	}
+
+	/* Keep it for next time, if it says it will stay fresh */
+	http_cache_store(&xfer);
+
+	tuple_out = http_response_form_tuple(tup_desc, long_status, content_type, &(xfer.si_headers), &(xfer.si_data));
+
+	/* Clean up, keeping the handle and its caches for next time */
+	ReleaseTupleDesc(tup_desc);
+	http_pool_note_transfer(g_http_handle);
+	http_transfer_cleanup(&xfer);
+
+	/* Return */
+	PG_RETURN_DATUM(HeapTupleGetDatum(tuple_out));
+}
+
+/**
+* Run a GET or HEAD request like http(), for callers declared
+* PARALLEL SAFE. Requests that change things on the server are
+* refused, since parallel workers run them in no particular
+* order, and an error in one worker leaves the others' done.
+*/
+Datum http_request_readonly(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(http_request_readonly);
+Datum http_request_readonly(PG_FUNCTION_ARGS)
+{
+	Datum method;
+	bool isnull;
+	http_method m;
+
+	if ( PG_ARGISNULL(0) )
+		elog(ERROR, "An http_request must be provided");
+
+	method = GetAttributeByNum(PG_GETARG_HEAPTUPLEHEADER(0), REQ_METHOD + 1, &isnull);
+	m = isnull ? HTTP_UNKNOWN : request_type(TextDatumGetCString(method));
+	if ( m != HTTP_GET && m != HTTP_HEAD )
+		ereport(ERROR,
+		        (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+		         errmsg("http_parallel() only runs GET and HEAD requests")));
+
+	return http_request(fcinfo);
+}
+
+/**
+* Release every transfer of an http_multi() batch that is
+* still attached to the multi handle.
+*/
+static void
+http_multi_cleanup(CURLM *multi, http_transfer *xfers, int nxfers)
+{
+	int i;
+	for (i = 0; i < nxfers; i++)
+	{
+		if (!xfers[i].handle)
+			continue;
+		curl_multi_remove_handle(multi, xfers[i].handle);
+		curl_easy_cleanup(xfers[i].handle);
+		xfers[i].handle = NULL;
+		http_transfer_cleanup(&xfers[i]);
+	}
+}
+
+/*
+* Start a transfer of an http_multi() batch that has been
+* admitted, or report it at once if it is marked to fail.
+* Returns whether it was started.
+*/
+static bool
+http_multi_start(CURLM *multi, http_transfer *xfer, Tuplestorestate *tupstore,
+                 TupleDesc tupdesc, TupleDesc resp_tupdesc)
+{
+	CURLMcode mcode;
+
+	/* Transfers known to fail are reported without running */
+	if ( xfer->fail_fast != CURLE_OK )
+	{
+		Datum values[2];
+		bool nulls[2] = {false, true};
+		http_transfer_done(xfer, xfer->fail_fast);
+		values[0] = Int32GetDatum(xfer->ordinality);
+		values[1] = (Datum)0;
+		if ( xfer->fallback_status )
+		{
+			values[1] = HeapTupleGetDatum(http_response_form_tuple(resp_tupdesc,
+			              xfer->fallback_status, NULL, &(xfer->si_headers), &(xfer->si_data)));
+			nulls[1] = false;
+		}
+		else
+			ereport(WARNING,
+			        (errmsg("%s", xfer->error_buffer),
+			         errdetail("http_multi request %d, '%s'", xfer->ordinality, xfer->uri)));
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		curl_easy_cleanup(xfer->handle);
+		xfer->handle = NULL;
+		http_transfer_cleanup(xfer);
+		return false;
+	}
+
+	mcode = curl_multi_add_handle(multi, xfer->handle);
+	if ( mcode != CURLM_OK )
+		ereport(ERROR, (errmsg("%s", curl_multi_strerror(mcode))));
+	return true;
+}
+
+/**
+* Run an array of http_request tuples concurrently on a curl
+* multi handle, with at most max_concurrency transfers in flight
+* at any time. Returns (ordinality, http_response) rows, where
+* ordinality is the position of the request in the input array.
+* Transfers that fail at the curl level emit a WARNING and
+* return a NULL response, so one bad endpoint does not lose
+* the results of the whole batch. A transfer held back by its
+* host's rate limit keeps its place in the pipeline, and is
+* started when the limit allows, while the others run.
+*/
+Datum http_multi(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(http_multi);
+Datum http_multi(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	MemoryContext oldcontext;
+	Tuplestorestate *tupstore;
+	TupleDesc tupdesc;
+	TupleDesc resp_tupdesc;
+
+	ArrayType *array;
+	Oid elem_type;
+	int16 elem_len;
+	bool elem_byval;
+	char elem_align;
+	Datum *elems;
+	bool *elem_nulls;
+	int nelems;
+	int max_concurrency;
+
+	CURLM *multi;
+	http_transfer *xfers;
+	http_spill_scope spill;
+	int next = 0;
+	int nactive = 0;
+	int ndeferred = 0;
+
+	/* Version check */
+	http_check_curl_version(curl_version_info(CURLVERSION_NOW));
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+		!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("%s called with incompatible return type", __func__)));
+
+	/* Declare SQL function strict, so no test for NULL input */
+	max_concurrency = PG_GETARG_INT32(1);
+	if ( max_concurrency < 1 )
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("max_concurrency must be at least 1")));
+
+	/* Set up the result set in the per-query memory context */
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupdesc = CreateTupleDescCopy(tupdesc);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	/* Break the request array into elements */
+	array = PG_GETARG_ARRAYTYPE_P(0);
+	elem_type = ARR_ELEMTYPE(array);
+	get_typlenbyvalalign(elem_type, &elem_len, &elem_byval, &elem_align);
+	deconstruct_array(array, elem_type, elem_len, elem_byval, elem_align,
+	                  &elems, &elem_nulls, &nelems);
+
+	if ( nelems == 0 )
+		return (Datum) 0;
+
+	resp_tupdesc = typname_get_tupledesc("http", "http_response");
+	xfers = palloc0(nelems * sizeof(http_transfer));
+
+	multi = http_get_multi();
+
+	PG_TRY();
+	{
+		/* One spill subtransaction covers all the transfers */
+		http_spill_begin(&spill);
+
+		while ( next < nelems || nactive > 0 )
+		{
+			CURLMcode mcode;
+			CURLMsg *msg;
+			int still_running = 0;
+			int msgs_left = 0;
+			long timeout_ms = 1000;
+			int i;
+
+			/* Offer the held back transfers to their rate limits again */
+			for ( i = 0; ndeferred > 0 && i < next; i++ )
+			{
+				http_transfer *xfer = xfers + i;
+
+				if ( !xfer->handle || !xfer->deferred || xfer->admit_at > GetCurrentTimestamp() )
+					continue;
+				if ( !http_transfer_admit_nowait(xfer) )
+					continue;
+				ndeferred--;
+				if ( !http_multi_start(multi, xfer, tupstore, tupdesc, resp_tupdesc) )
+					nactive--;
+			}
+
+			/* Keep the pipeline topped up to max_concurrency */
+			while ( next < nelems && nactive < max_concurrency )
+			{
+				http_transfer *xfer = xfers + next;
+				xfer->ordinality = ++next;
+
+				/* Null requests get null responses */
+				if ( elem_nulls[xfer->ordinality - 1] )
+				{
+					Datum values[2];
+					bool nulls[2] = {false, true};
+					values[0] = Int32GetDatum(xfer->ordinality);
+					values[1] = (Datum)0;
+					tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+					continue;
+				}
+
+				xfer->handle = curl_easy_init();
+				if (!xfer->handle)
+					ereport(ERROR, (errmsg("Unable to initialize CURL")));
+				http_handle_init(xfer->handle);
+				http_transfer_setup(xfer, DatumGetHeapTupleHeader(elems[xfer->ordinality - 1]));
+				xfer->spill_scope = &spill;
+
+				if ( !http_transfer_admit_nowait(xfer) )
+				{
+					/* Held back, it still takes up a place */
+					ndeferred++;
+					nactive++;
+				}
+				else if ( http_multi_start(multi, xfer, tupstore, tupdesc, resp_tupdesc) )
+					nactive++;
+			}
+
+			if ( nactive == 0 )
+				continue;
+
+			/* Wake up in time for the next held back transfer */
+			for ( i = 0; ndeferred > 0 && i < next; i++ )
+				timeout_ms = http_transfer_admit_timeout(xfers + i, timeout_ms);
+
+#if PG_VERSION_NUM >= 170000
+			http_transfer_wait_start();
+#endif
+			mcode = curl_multi_perform(multi, &still_running);
+			if ( mcode == CURLM_OK && still_running )
+				mcode = curl_multi_wait(multi, NULL, 0, (int) timeout_ms, NULL);
+#if PG_VERSION_NUM >= 170000
+			http_transfer_wait_end();
+#endif
+			if ( mcode != CURLM_OK )
+				ereport(ERROR, (errmsg("%s", curl_multi_strerror(mcode))));
+
+			/* With nothing running, sleep until a held back transfer may start */
+			if ( !still_running && ndeferred > 0 && timeout_ms > 0 )
+			{
+				(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+				                 timeout_ms, wait_event_rate_limit);
+				ResetLatch(MyLatch);
+			}
+
+			/* Cancel requests are also flagged by the progress callback */
+			CHECK_FOR_INTERRUPTS();
+
+			/* Harvest the completed transfers */
+			while ( (msg = curl_multi_info_read(multi, &msgs_left)) )
+			{
+				http_transfer *xfer = NULL;
+				Datum values[2];
+				bool nulls[2] = {false, false};
+
+				if ( msg->msg != CURLMSG_DONE )
+					continue;
+
+				curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&xfer);
+				elog(DEBUG2, "pgsql-http: queried '%s'", xfer->uri);
+				elog(DEBUG2, "pgsql-http: http_return '%d'", msg->data.result);
+				http_transfer_done(xfer, msg->data.result);
+
+				values[0] = Int32GetDatum(xfer->ordinality);
+				if ( msg->data.result == CURLE_OK )
+				{
+					HeapTuple resp = http_transfer_response(xfer, resp_tupdesc);
+					http_pool_note_transfer(msg->easy_handle);
+					values[1] = HeapTupleGetDatum(resp);
+				}
+				else
+				{
+#if LIBCURL_VERSION_NUM >= 0x072700 /* 7.39.0 */
+					if ( msg->data.result == CURLE_ABORTED_BY_CALLBACK )
+						elog(ERROR, "canceling statement due to user request");
+#endif
+					ereport(WARNING,
+					        (errmsg("%s", strlen(xfer->error_buffer) > 0 ?
+					                      xfer->error_buffer :
+					                      curl_easy_strerror(msg->data.result)),
+					         errdetail("http_multi request %d, '%s'", xfer->ordinality, xfer->uri)));
+					values[1] = (Datum)0;
+					nulls[1] = true;
+				}
+				tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+
+				curl_multi_remove_handle(multi, xfer->handle);
+				curl_easy_cleanup(xfer->handle);
+				xfer->handle = NULL;
+				http_transfer_cleanup(xfer);
+				nactive--;
+			}
+		}
+
+		http_spill_end(&spill);
+	}
+	PG_CATCH();
+	{
+		ErrorData *edata;
+
+		MemoryContextSwitchTo(oldcontext);
+		edata = CopyErrorData();
+		FlushErrorState();
+		http_spill_abort(&spill);
+		http_multi_cleanup(multi, xfers, nelems);
+		ReThrowError(edata);
+	}
+	PG_END_TRY();
+
+	http_multi_cleanup(multi, xfers, nelems);
+	ReleaseTupleDesc(resp_tupdesc);
+	pfree(xfers);
+
+	return (Datum) 0;
+}
+
+
+
+
+/*************************************************************************
+* Streaming responses
+*
+* Rather than collecting the whole body before returning,
+* the transfer is run on its own multi handle a little at a
+* time, and the body handed back as a set of chunks, lines or
+* JSON records as it arrives. The transfer is paused whenever a chunk's
+* worth of data is waiting to be returned, so memory use is
+* bounded by the chunk size, not the size of the response.
+*************************************************************************/
+
+typedef enum {
+	HTTP_STREAM_CHUNKS,
+	HTTP_STREAM_LINES,
+	HTTP_STREAM_RECORDS     /* newline-delimited JSON or JSON text sequences */
+} http_stream_mode;
+
+/* Record separator of JSON text sequences (RFC 7464) */
+#define HTTP_JSON_SEQ_RS '\x1e'
+
+typedef struct {
+	http_transfer xfer;
+	CURLM *multi;
+	http_stream_mode mode;
+	int chunk_size;
+	int pos;            /* start of the unreturned data in xfer.si_data */
+	int charset;        /* charset of the content, -1 if none or unknown */
+	bool charset_known;
+	bool want_more;     /* a line is longer than the chunk size */
+	bool paused;
+	bool done;
+	CURLcode result;
+	int64 records;      /* JSON records returned so far */
+} http_stream_state;
+
+/*
+* Write callback that pauses the transfer, rather than
+* buffering more, while a chunk is waiting to be returned.
+* Data refused with CURL_WRITEFUNC_PAUSE is delivered again
+* once the transfer is unpaused.
+*/
+static size_t
+http_stream_writeback(void *contents, size_t size, size_t nmemb, void *userp)
+{
+	http_stream_state *state = (http_stream_state *) userp;
+	StringInfo si = &(state->xfer.si_data);
+	size_t realsize = size * nmemb;
+
+	if (si->len - state->pos >= state->chunk_size && !state->want_more)
+	{
+		state->paused = true;
+		return CURL_WRITEFUNC_PAUSE;
+	}
+
+	appendBinaryStringInfo(si, (const char*)contents, (int)realsize);
+	return realsize;
+}
+
+/*
+* Release the curl resources of a stream when its memory
+* context goes away, whether the set was read to the end,
+* cut short by a LIMIT, or abandoned by an error.
+*/
+static void
+http_stream_release(void *arg)
+{
+	http_stream_state *state = (http_stream_state *) arg;
+
+	if (state->xfer.handle)
+	{
+		curl_multi_remove_handle(state->multi, state->xfer.handle);
+		curl_easy_cleanup(state->xfer.handle);
+		state->xfer.handle = NULL;
+	}
+	if (state->multi)
+		curl_multi_cleanup(state->multi);
+	state->multi = NULL;
+	if (state->xfer.headers)
+		curl_slist_free_all(state->xfer.headers);
+	state->xfer.headers = NULL;
+	if (state->xfer.resolve)
+		curl_slist_free_all(state->xfer.resolve);
+	state->xfer.resolve = NULL;
+}
+
+/*
+* Set up the transfer for a stream in the current memory
+* context, which must last until the stream is released.
+*/
+static http_stream_state *
+http_stream_begin(HeapTupleHeader rec, http_stream_mode mode, int chunk_size)
+{
+	http_stream_state *state = palloc0(sizeof(http_stream_state));
+	MemoryContextCallback *cb = palloc0(sizeof(MemoryContextCallback));
+	CURLMcode mcode;
+
+	state->mode = mode;
+	state->chunk_size = chunk_size;
+	state->charset = -1;
+
+	cb->func = http_stream_release;
+	cb->arg = state;
+	MemoryContextRegisterResetCallback(CurrentMemoryContext, cb);
+
+	state->multi = curl_multi_init();
+	if (!state->multi)
+		ereport(ERROR, (errmsg("Unable to initialize CURL multi handle")));
+
+	state->xfer.handle = curl_easy_init();
+	if (!state->xfer.handle)
+		ereport(ERROR, (errmsg("Unable to initialize CURL")));
+	http_handle_init(state->xfer.handle);
+	http_transfer_setup(&(state->xfer), rec);
+	http_transfer_admit(&(state->xfer));
+
+	/* There is no status to return, so failures must be errors */
+	curl_easy_setopt(state->xfer.handle, CURLOPT_FAILONERROR, 1L);
+	curl_easy_setopt(state->xfer.handle, CURLOPT_WRITEFUNCTION, http_stream_writeback);
+	curl_easy_setopt(state->xfer.handle, CURLOPT_WRITEDATA, (void*)state);
+
+	if (state->xfer.fail_fast != CURLE_OK)
+	{
+		state->done = true;
+		state->result = state->xfer.fail_fast;
+		return state;
+	}
+
+	mcode = curl_multi_add_handle(state->multi, state->xfer.handle);
+	if (mcode != CURLM_OK)
+		ereport(ERROR, (errmsg("%s", curl_multi_strerror(mcode))));
+
+	return state;
+}
+
+/*
+* Run the transfer until something more has happened.
+*/
+static void
+http_stream_perform(http_stream_state *state)
+{
+	CURLMcode mcode;
+	CURLMsg *msg;
+	int still_running = 0;
+	int msgs_left = 0;
+
+#if PG_VERSION_NUM >= 170000
+	http_transfer_wait_start();
+#endif
+	mcode = curl_multi_perform(state->multi, &still_running);
+	if (mcode == CURLM_OK && still_running)
+		mcode = curl_multi_wait(state->multi, NULL, 0, 1000, NULL);
+#if PG_VERSION_NUM >= 170000
+	http_transfer_wait_end();
+#endif
+	if (mcode != CURLM_OK)
+		ereport(ERROR, (errmsg("%s", curl_multi_strerror(mcode))));
+
+	CHECK_FOR_INTERRUPTS();
+
+	while ((msg = curl_multi_info_read(state->multi, &msgs_left)))
+	{
+		if (msg->msg != CURLMSG_DONE)
+			continue;
+
+		state->done = true;
+		state->result = msg->data.result;
+		elog(DEBUG2, "pgsql-http: queried '%s'", state->xfer.uri);
+		elog(DEBUG2, "pgsql-http: http_return '%d'", state->result);
+
+		http_transfer_done(&(state->xfer), state->result);
+		if (state->result == CURLE_OK)
+			http_pool_note_transfer(state->xfer.handle);
+	}
+}
+
+/*
+* Find the next chunk or line of the body, running the
+* transfer as needed. Returns false at the end of the body.
+* The data returned points into the stream buffer, and is
+* only valid until the next call.
+*/
+static bool
+http_stream_next(http_stream_state *state, char **data, int *len)
+{
+	StringInfo si = &(state->xfer.si_data);
+
+	for (;;)
+	{
+		int avail = si->len - state->pos;
+		char *start = si->data + state->pos;
+
+		if (state->mode == HTTP_STREAM_CHUNKS)
+		{
+			if (avail >= state->chunk_size || (state->done && avail > 0))
+			{
+				*data = start;
+				*len = Min(avail, state->chunk_size);
+				state->pos += *len;
+				return true;
+			}
+		}
+		else
+		{
+			char *eol = memchr(start, '\n', avail);
+			if (state->mode == HTTP_STREAM_RECORDS)
+			{
+				/* Records end at a newline or the start of the next */
+				char *rs = memchr(start, HTTP_JSON_SEQ_RS, eol ? eol - start : avail);
+				if (rs)
+					eol = rs;
+			}
+			if (eol || (state->done && avail > 0))
+			{
+				*data = start;
+				*len = eol ? eol - start : avail;
+				state->pos += eol ? *len + 1 : avail;
+				state->want_more = false;
+
+				/* Strip the carriage-returns, because who cares? */
+				if (*len > 0 && start[*len - 1] == '\r')
+					(*len)--;
+				return true;
+			}
+		}
+
+		if (state->done)
+		{
+			if (state->result == CURLE_OK)
+				return false;
+#if LIBCURL_VERSION_NUM >= 0x072700 /* 7.39.0 */
+			if (state->result == CURLE_ABORTED_BY_CALLBACK)
+				elog(ERROR, "canceling statement due to user request");
+#endif
+			http_error(state->result, state->xfer.error_buffer);
+		}
+
+		/* Make room at the front of the buffer, then get more data */
+		if (state->pos > 0)
+		{
+			memmove(si->data, start, avail);
+			si->len = avail;
+			si->data[si->len] = '\0';
+			state->pos = 0;
+		}
+		state->want_more = (state->mode != HTTP_STREAM_CHUNKS && avail >= state->chunk_size);
+
+		if (state->paused)
+		{
+			/* Unpausing may deliver data right away */
+			state->paused = false;
+			curl_easy_pause(state->xfer.handle, CURLPAUSE_CONT);
+			continue;
+		}
+
+		http_stream_perform(state);
+	}
+}
+
+/*
+* Convert text from the stream to the server encoding, if the
+* response says what its charset is.
+*/
+static char *
+http_stream_transcode(http_stream_state *state, char *data, int *len)
+{
+	if (!state->charset_known)
+	{
+		char *content_type = NULL;
+		curl_easy_getinfo(state->xfer.handle, CURLINFO_CONTENT_TYPE, &content_type);
+		state->charset = http_content_charset(content_type);
+		state->charset_known = true;
+	}
+	if (state->charset >= 0)
+	{
+		data = pg_any_to_server(data, *len, state->charset);
+		*len = strlen(data);
+	}
+	return data;
+}
+
+static void
+http_stream_record_context(void *arg)
+{
+	http_stream_state *state = (http_stream_state *) arg;
+	errcontext("JSON record " INT64_FORMAT " of \"%s\"", state->records + 1, state->xfer.uri);
+}
+
+/*
+* Parse the next JSON record of the stream into a jsonb,
+* passing over empty records. Returns false at the end of
+* the body.
+*/
+static bool
+http_stream_next_record(http_stream_state *state, Datum *record)
+{
+	ErrorContextCallback errcallback;
+	char *data;
+	int len;
+
+	for (;;)
+	{
+		int i;
+
+		if (!http_stream_next(state, &data, &len))
+			return false;
+		/* Records of only whitespace, stray carriage-returns included, are blank */
+		for (i = 0; i < len; i++)
+			if (!HTTP_IS_WS(data[i]) && data[i] != '\r' && data[i] != '\n')
+				break;
+		if (i < len)
+			break;
+	}
+
+	data = http_stream_transcode(state, data, &len);
+	data = pnstrdup(data, len);
+
+	errcallback.callback = http_stream_record_context;
+	errcallback.arg = (void *) state;
+	errcallback.previous = error_context_stack;
+	error_context_stack = &errcallback;
+	*record = DirectFunctionCall1(jsonb_in, CStringGetDatum(data));
+	error_context_stack = errcallback.previous;
+
+	state->records++;
+	pfree(data);
+	return true;
+}
+
+static Datum
+http_stream_srf(FunctionCallInfo fcinfo, http_stream_mode mode, int chunk_size)
+{
+	FuncCallContext *funcctx;
+	http_stream_state *state;
+	char *data;
+	int len;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext oldcontext;
+		HeapTupleHeader rec;
+
+		/* Version check */
+		http_check_curl_version(curl_version_info(CURLVERSION_NOW));
+
+		if (chunk_size < 1)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("chunk_size must be at least 1")));
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+		/* The request, and the content sent from it, must last the whole scan */
+		rec = PG_GETARG_HEAPTUPLEHEADER(0);
+		funcctx->user_fctx = http_stream_begin(rec, mode, chunk_size);
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	state = (http_stream_state *) funcctx->user_fctx;
+
+	if (mode == HTTP_STREAM_RECORDS)
+	{
+		Datum record;
+		if (!http_stream_next_record(state, &record))
+			SRF_RETURN_DONE(funcctx);
+		SRF_RETURN_NEXT(funcctx, record);
+	}
+
+	if (!http_stream_next(state, &data, &len))
+		SRF_RETURN_DONE(funcctx);
+
+	if (mode == HTTP_STREAM_CHUNKS)
+	{
+		bytea *chunk = palloc(VARHDRSZ + len);
+		SET_VARSIZE(chunk, VARHDRSZ + len);
+		memcpy(VARDATA(chunk), data, len);
+		SRF_RETURN_NEXT(funcctx, PointerGetDatum(chunk));
+	}
+
+	data = http_stream_transcode(state, data, &len);
+	SRF_RETURN_NEXT(funcctx, PointerGetDatum(cstring_to_text_with_len(data, len)));
+}
+
+/**
+* Return the body of an http_request as a set of bytea
+* chunks of chunk_size bytes, read as the response arrives.
+*/
+Datum http_stream(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(http_stream);
+Datum http_stream(PG_FUNCTION_ARGS)
+{
+	return http_stream_srf(fcinfo, HTTP_STREAM_CHUNKS, PG_GETARG_INT32(1));
+}
+
+/**
+* Return the body of an http_request as a set of text
+* lines, read as the response arrives.
+*/
+Datum http_stream_lines(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(http_stream_lines);
+Datum http_stream_lines(PG_FUNCTION_ARGS)
+{
+	return http_stream_srf(fcinfo, HTTP_STREAM_LINES, 65536);
+}
+
+/**
+* Return the body of an http_request, in newline-delimited
+* JSON or as a JSON text sequence, as a set of jsonb records
+* parsed as the response arrives.
+*/
+Datum http_stream_ndjson(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(http_stream_ndjson);
+Datum http_stream_ndjson(PG_FUNCTION_ARGS)
+{
+	return http_stream_srf(fcinfo, HTTP_STREAM_RECORDS, 65536);
+}
+
+
+/*************************************************************************
+* Large object transfers
+*
+* Bodies are moved between curl and a large object a block
+* at a time, from inside the curl callbacks, so they never
+* have to fit in memory, or under the 1GB limit on a value.
+*************************************************************************/
+
+typedef struct {
+	LargeObjectDesc *lo;
+	ErrorData *error;    /* error raised inside a callback */
+	MemoryContext mcxt;  /* context of the caller */
+	ResourceOwner owner; /* resource owner of the caller */
+} http_lo_state;
+
+/*
+* Errors cannot be thrown through curl, so the transfer runs
+* in a subtransaction, and one raised while reading or
+* writing the large object is caught and kept, and the
+* subtransaction rolled back at once, releasing any locks
+* and pins the failed call held. The transfer is aborted,
+* and the error thrown again once curl has returned.
+*/
+static void
+http_lo_begin(http_lo_state *state)
+{
+	state->mcxt = CurrentMemoryContext;
+	state->owner = CurrentResourceOwner;
+	BeginInternalSubTransaction(NULL);
+	MemoryContextSwitchTo(state->mcxt);
+}
+
+static void
+http_lo_catch(http_lo_state *state)
+{
+	MemoryContextSwitchTo(state->mcxt);
+	state->error = CopyErrorData();
+	FlushErrorState();
+	RollbackAndReleaseCurrentSubTransaction();
+	MemoryContextSwitchTo(state->mcxt);
+	CurrentResourceOwner = state->owner;
+}
+
+static void
+http_lo_end(http_lo_state *state)
+{
+	/* After an error the subtransaction is already gone */
+	if (state->error)
+		return;
+	ReleaseCurrentSubTransaction();
+	MemoryContextSwitchTo(state->mcxt);
+	CurrentResourceOwner = state->owner;
+}
+
+static size_t
+http_lo_writeback(void *contents, size_t size, size_t nmemb, void *userp)
+{
+	http_lo_state *state = (http_lo_state *) userp;
+	size_t realsize = size * nmemb;
+
+	if (state->error)
+		return 0;
+
+	PG_TRY();
+	{
+		inv_write(state->lo, (const char *) contents, (int) realsize);
+	}
+	PG_CATCH();
+	{
+		http_lo_catch(state);
+		realsize = 0;
+	}
+	PG_END_TRY();
+
+	return realsize;
+}
+
+static size_t
+http_lo_readback(void *buffer, size_t size, size_t nitems, void *instream)
+{
+	http_lo_state *state = (http_lo_state *) instream;
+	size_t readsize = 0;
+
+	if (state->error)
+		return CURL_READFUNC_ABORT;
+
+	PG_TRY();
+	{
+		readsize = inv_read(state->lo, (char *) buffer, (int) (size * nitems));
+	}
+	PG_CATCH();
+	{
+		http_lo_catch(state);
+		readsize = CURL_READFUNC_ABORT;
+	}
+	PG_END_TRY();
+
+	return readsize;
+}
+
+/*
+* Run a large object transfer on the global handle, raising
+* any error from curl or from the callbacks.
+*/
+static void
+http_lo_perform(http_transfer *xfer, http_lo_state *state)
+{
+	CURLcode http_return;
+
+	http_transfer_admit(xfer);
+
+#if PG_VERSION_NUM >= 170000
+	http_transfer_wait_start();
+#endif
+	if ( xfer->fail_fast != CURLE_OK )
+		http_return = xfer->fail_fast;
+	else
+	{
+		http_lo_begin(state);
+		http_return = curl_easy_perform(xfer->handle);
+		http_lo_end(state);
+	}
+#if PG_VERSION_NUM >= 170000
+	http_transfer_wait_end();
+#endif
+
+	elog(DEBUG2, "pgsql-http: queried '%s'", xfer->uri);
+	elog(DEBUG2, "pgsql-http: http_return '%d'", http_return);
+	http_transfer_done(xfer, http_return);
+
+	if ( http_return != CURLE_OK || state->error )
+	{
+		http_transfer_cleanup(xfer);
+		curl_easy_cleanup(g_http_handle);
+		g_http_handle = NULL;
+
+		if ( state->error )
+			ReThrowError(state->error);
+#if LIBCURL_VERSION_NUM >= 0x072700 /* 7.39.0 */
+		if ( http_return == CURLE_ABORTED_BY_CALLBACK )
+			elog(ERROR, "canceling statement due to user request");
+#endif
+		http_error(http_return, xfer->error_buffer);
+	}
+	http_pool_note_transfer(xfer->handle);
+}
+
+/**
+* Run an http_request and write the response body into a
+* new large object, returning its oid. There is no status to
+* return, so a response with an error status is an error.
+*/
+Datum http_to_lo(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(http_to_lo);
+Datum http_to_lo(PG_FUNCTION_ARGS)
+{
+	HeapTupleHeader rec = PG_GETARG_HEAPTUPLEHEADER(0);
+	http_transfer xfer;
+	http_lo_state state;
+	Oid lobj;
+
+	/* Version check */
+	http_check_curl_version(curl_version_info(CURLVERSION_NOW));
+
+	memset(&xfer, 0, sizeof(xfer));
+	memset(&state, 0, sizeof(state));
+	xfer.handle = g_http_handle = http_get_handle();
+	http_transfer_setup(&xfer, rec);
+
+	lobj = inv_create(InvalidOid);
+	state.lo = inv_open(lobj, INV_WRITE, CurrentMemoryContext);
+
+	curl_easy_setopt(xfer.handle, CURLOPT_FAILONERROR, 1L);
+	curl_easy_setopt(xfer.handle, CURLOPT_WRITEFUNCTION, http_lo_writeback);
+	curl_easy_setopt(xfer.handle, CURLOPT_WRITEDATA, (void*)&state);
+
+	http_lo_perform(&xfer, &state);
+
+	inv_close(state.lo);
+	http_transfer_cleanup(&xfer);
+	PG_RETURN_OID(lobj);
+}
+
+/**
+* Run an http_request with the contents of a large object
+* as the body, returning the http_response. The request
+* content must be non-NULL (usually empty) to give the
+* request a body, and is replaced by the large object.
+*/
+Datum http_from_lo(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(http_from_lo);
+Datum http_from_lo(PG_FUNCTION_ARGS)
+{
+	HeapTupleHeader rec = PG_GETARG_HEAPTUPLEHEADER(0);
+	Oid lobj = PG_GETARG_OID(1);
+	http_transfer xfer;
+	http_lo_state state;
+	TupleDesc tup_desc;
+	HeapTuple tuple_out;
+	long long_status;
+	char *content_type = NULL;
+	curl_off_t lo_size;
+
+	/* Version check */
+	http_check_curl_version(curl_version_info(CURLVERSION_NOW));
+
+	tup_desc = http_call_result_tupdesc(fcinfo);
+
+	memset(&xfer, 0, sizeof(xfer));
+	memset(&state, 0, sizeof(state));
+	state.lo = inv_open(lobj, INV_READ, CurrentMemoryContext);
+	lo_size = (curl_off_t) inv_seek(state.lo, 0, SEEK_END);
+	inv_seek(state.lo, 0, SEEK_SET);
+
+	xfer.handle = g_http_handle = http_get_handle();
+	http_transfer_setup(&xfer, rec);
+	if (!xfer.body)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("http_request.content must not be NULL when sending a large object")));
+
+	curl_easy_setopt(xfer.handle, CURLOPT_READFUNCTION, http_lo_readback);
+	curl_easy_setopt(xfer.handle, CURLOPT_READDATA, (void*)&state);
+	if (xfer.method == HTTP_GET || xfer.method == HTTP_POST || xfer.method == HTTP_DELETE)
+	{
+		/* Without POSTFIELDS the post body comes from the read callback */
+		curl_easy_setopt(xfer.handle, CURLOPT_POSTFIELDS, NULL);
+		curl_easy_setopt(xfer.handle, CURLOPT_POSTFIELDSIZE_LARGE, lo_size);
+	}
+	else
+		curl_easy_setopt(xfer.handle, CURLOPT_INFILESIZE_LARGE, lo_size);
+
+	http_lo_perform(&xfer, &state);
+	inv_close(state.lo);
+
+	if ( (CURLE_OK != curl_easy_getinfo(xfer.handle, CURLINFO_RESPONSE_CODE, &long_status)) ||
+		 (CURLE_OK != curl_easy_getinfo(xfer.handle, CURLINFO_CONTENT_TYPE, &content_type)) )
+	{
+		http_transfer_cleanup(&xfer);
+		curl_easy_cleanup(g_http_handle);
+		g_http_handle = NULL;
+		ereport(ERROR, (errmsg("CURL: Error in curl_easy_getinfo")));
+	}
+
+	tuple_out = http_response_form_tuple(tup_desc, long_status, content_type, &(xfer.si_headers), &(xfer.si_data));
+	http_transfer_cleanup(&xfer);
+	PG_RETURN_DATUM(HeapTupleGetDatum(tuple_out));
+}
+
+
+/*************************************************************************
+* Prepared request templates
+*
+* A template is a request set up once, on a curl handle of
+* its own, with the method, headers and curl options already
+* applied. Executing it only sets the parts that vary, the
+* path appended to the template URI and the content.
+*************************************************************************/
+
+typedef struct {
+	char name[NAMEDATALEN];
+	http_transfer xfer;
+	char *base_uri;
+	const char *body; /* template content, NULL if none */
+	size_t body_len;
+	MemoryContext mcxt;
+} http_template;
+
+static HTAB *g_templates = NULL;
+
+static http_template *
+http_template_lookup(const char *name, bool missing_ok)
+{
+	char key[NAMEDATALEN];
+	http_template *tmpl = NULL;
+
+	if (g_templates)
+	{
+		memset(key, 0, sizeof(key));
+		strlcpy(key, name, NAMEDATALEN);
+		tmpl = hash_search(g_templates, key, HASH_FIND, NULL);
+	}
+
+	if (!tmpl && !missing_ok)
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("prepared http request \"%s\" does not exist", name)));
+	return tmpl;
+}
+
+static void
+http_template_release(http_template *tmpl)
+{
+	if (tmpl->xfer.handle)
+		curl_easy_cleanup(tmpl->xfer.handle);
+	tmpl->xfer.handle = NULL;
+	if (tmpl->xfer.headers)
+		curl_slist_free_all(tmpl->xfer.headers);
+	tmpl->xfer.headers = NULL;
+	if (tmpl->xfer.resolve)
+		curl_slist_free_all(tmpl->xfer.resolve);
+	tmpl->xfer.resolve = NULL;
+	if (tmpl->mcxt)
+		MemoryContextDelete(tmpl->mcxt);
+	tmpl->mcxt = NULL;
+}
+
+/**
+* Prepare an http_request as a named template for later
+* calls to http_execute(). The curl options in effect now
+* are the ones the template will use.
+*/
+Datum http_prepare(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(http_prepare);
+Datum http_prepare(PG_FUNCTION_ARGS)
+{
+	char *name = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	char key[NAMEDATALEN];
+	http_template tmpl;
+	http_template *entry;
+	MemoryContext oldcontext;
+	bool found;
+
+	/* Version check */
+	http_check_curl_version(curl_version_info(CURLVERSION_NOW));
+
+	if (strlen(name) >= NAMEDATALEN)
+		ereport(ERROR,
+				(errcode(ERRCODE_NAME_TOO_LONG),
+				 errmsg("prepared http request name \"%s\" is too long", name)));
+
+	if (http_template_lookup(name, true))
+		ereport(ERROR,
+				(errcode(ERRCODE_DUPLICATE_OBJECT),
+				 errmsg("prepared http request \"%s\" already exists", name)));
+
+	if (!g_templates)
+	{
+		HASHCTL info;
+		memset(&info, 0, sizeof(info));
+		info.keysize = NAMEDATALEN;
+		info.entrysize = sizeof(http_template);
+#if PG_VERSION_NUM >= 140000
+		g_templates = hash_create("pgsql-http templates", 16, &info, HASH_ELEM | HASH_STRINGS);
+#else
+		g_templates = hash_create("pgsql-http templates", 16, &info, HASH_ELEM);
+#endif
+	}
+
+	/* Everything the template holds lives in its own context */
+	memset(&tmpl, 0, sizeof(tmpl));
+	tmpl.xfer.handle = curl_easy_init();
+	if (!tmpl.xfer.handle)
+		ereport(ERROR, (errmsg("Unable to initialize CURL")));
+	tmpl.mcxt = AllocSetContextCreate(TopMemoryContext, "pgsql-http template", ALLOCSET_SMALL_SIZES);
+	oldcontext = MemoryContextSwitchTo(tmpl.mcxt);
+	PG_TRY();
+	{
+		HeapTupleHeader rec = DatumGetHeapTupleHeader(datumCopy(PG_GETARG_DATUM(1), false, -1));
+
+		http_handle_init(tmpl.xfer.handle);
+		http_transfer_setup(&(tmpl.xfer), rec);
+		tmpl.base_uri = pstrdup(tmpl.xfer.uri);
+		tmpl.body = tmpl.xfer.body;
+		tmpl.body_len = tmpl.xfer.body_len;
+	}
+	PG_CATCH();
+	{
+		MemoryContextSwitchTo(oldcontext);
+		http_template_release(&tmpl);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	MemoryContextSwitchTo(oldcontext);
+
+	memset(key, 0, sizeof(key));
+	strlcpy(key, name, NAMEDATALEN);
+	entry = hash_search(g_templates, key, HASH_ENTER, &found);
+	entry->xfer = tmpl.xfer;
+	entry->base_uri = tmpl.base_uri;
+	entry->body = tmpl.body;
+	entry->body_len = tmpl.body_len;
+	entry->mcxt = tmpl.mcxt;
+
+	/* The handle points at the transfer, which has moved */
+	curl_easy_setopt(entry->xfer.handle, CURLOPT_PRIVATE, (void*)&(entry->xfer));
+	curl_easy_setopt(entry->xfer.handle, CURLOPT_ERRORBUFFER, entry->xfer.error_buffer);
+	curl_easy_setopt(entry->xfer.handle, CURLOPT_WRITEDATA, (void*)&(entry->xfer));
+	curl_easy_setopt(entry->xfer.handle, CURLOPT_WRITEHEADER, (void*)&(entry->xfer.si_headers));
+	if (entry->xfer.method == HTTP_PUT || entry->xfer.method == HTTP_PATCH || entry->xfer.method == HTTP_UNKNOWN)
+		curl_easy_setopt(entry->xfer.handle, CURLOPT_READDATA, (void*)&(entry->xfer));
+
+	PG_RETURN_VOID();
+}
+
+/**
+* Run a prepared request, with the path appended to the
+* template URI, and the content (if any) replacing the
+* template content.
+*/
+Datum http_execute(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(http_execute);
+Datum http_execute(PG_FUNCTION_ARGS)
+{
+	http_template *tmpl;
+	http_transfer *xfer;
+	http_spill_scope spill;
+	CURL *handle;
+	TupleDesc tup_desc;
+	HeapTuple tuple_out;
+	CURLcode http_return;
+	MemoryContext oldcontext;
+
+	if (PG_ARGISNULL(0))
+		ereport(ERROR,
+				(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+				 errmsg("prepared http request name must not be NULL")));
+
+	tmpl = http_template_lookup(text_to_cstring(PG_GETARG_TEXT_PP(0)), false);
+	xfer = &(tmpl->xfer);
+	handle = xfer->handle;
+	tup_desc = http_call_result_tupdesc(fcinfo);
+
+	/* Start from clean buffers, in the template's context */
+	oldcontext = MemoryContextSwitchTo(tmpl->mcxt);
+	if (xfer->uri != tmpl->base_uri)
+		pfree(xfer->uri);
+	if (PG_ARGISNULL(1))
+		xfer->uri = tmpl->base_uri;
+	else
+		xfer->uri = psprintf("%s%s", tmpl->base_uri, text_to_cstring(PG_GETARG_TEXT_PP(1)));
+	/* The path may run on from the host, so look at it again */
+	if (xfer->host)
+		pfree(xfer->host);
+	xfer->host = http_uri_host(xfer->uri);
+	resetStringInfo(&(xfer->si_data));
+	resetStringInfo(&(xfer->si_headers));
+	MemoryContextSwitchTo(oldcontext);
+	memset(xfer->error_buffer, 0, sizeof(xfer->error_buffer));
+	xfer->received = 0;
+	xfer->too_large = false;
+	xfer->spill = NULL;   /* closed by now, at the latest by an abort */
+	xfer->spill_scope = NULL;
+	curl_easy_setopt(handle, CURLOPT_URL, xfer->uri);
+
+	/*
+	* Replace the content, which only has to outlive this call.
+	* Without new content, point the handle back at the template
+	* content, as an earlier call may have left it elsewhere.
+	*/
+	if (tmpl->body)
+	{
+		long content_size;
+
+		if (PG_ARGISNULL(2))
+		{
+			xfer->body = tmpl->body;
+			xfer->body_len = tmpl->body_len;
+		}
+		else
+		{
+			text *content_text = PG_GETARG_TEXT_PP(2);
+			xfer->body = VARDATA_ANY(content_text);
+			xfer->body_len = VARSIZE_ANY_EXHDR(content_text);
+		}
+		xfer->body_pos = 0;
+		content_size = xfer->body_len;
+
+		if (xfer->method == HTTP_GET || xfer->method == HTTP_POST || xfer->method == HTTP_DELETE)
+		{
+			curl_easy_setopt(handle, CURLOPT_POSTFIELDS, (char *)xfer->body);
+			curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE, content_size);
+		}
+		else
+			curl_easy_setopt(handle, CURLOPT_INFILESIZE, content_size);
+	}
+	else if (!PG_ARGISNULL(2))
+	{
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("prepared http request \"%s\" was prepared without content", tmpl->name)));
+	}
+
+	/* Look the host up again, the cached address may have expired */
+	curl_easy_setopt(handle, CURLOPT_RESOLVE, NULL);
+	if (xfer->resolve)
+		curl_slist_free_all(xfer->resolve);
+	xfer->resolve = NULL;
+	xfer->dns_lookup = xfer->dns_cached = false;
+	xfer->fail_fast = CURLE_OK;
+	xfer->circuit = false;
+	xfer->fallback_status = 0;
+	http_dns_cache_apply(xfer);
+	http_transfer_admit(xfer);
+	if (xfer->fallback_status)
+		PG_RETURN_DATUM(HeapTupleGetDatum(http_response_form_tuple(tup_desc, xfer->fallback_status, NULL,
+		                                                           &(xfer->si_headers), &(xfer->si_data))));
+
+#if PG_VERSION_NUM >= 170000
+	http_transfer_wait_start();
+#endif
+	if (xfer->fail_fast != CURLE_OK)
+		http_return = xfer->fail_fast;
+	else
+	{
+		xfer->spill_scope = &spill;
+		http_spill_begin(&spill);
+		http_return = curl_easy_perform(handle);
+		http_spill_end(&spill);
+	}
+#if PG_VERSION_NUM >= 170000
+	http_transfer_wait_end();
+#endif
+
+	elog(DEBUG2, "pgsql-http: queried '%s'", xfer->uri);
+	elog(DEBUG2, "pgsql-http: http_return '%d'", http_return);
+	http_transfer_done(xfer, http_return);
+	xfer->spill_scope = NULL;   /* the template outlives this call */
+
+	if (http_return != CURLE_OK)
+	{
+#if LIBCURL_VERSION_NUM >= 0x072700 /* 7.39.0 */
+		if (http_return == CURLE_ABORTED_BY_CALLBACK)
+			elog(ERROR, "canceling statement due to user request");
+#endif
+		http_error(http_return, xfer->error_buffer);
+	}
+
+	http_pool_note_transfer(handle);
+	tuple_out = http_transfer_response(xfer, tup_desc);
+
+	/* Do not hold on to the memory of an unusually large response */
+	if (xfer->si_data.maxlen > 1024 * 1024)
+	{
+		oldcontext = MemoryContextSwitchTo(tmpl->mcxt);
+		pfree(xfer->si_data.data);
+		initStringInfo(&(xfer->si_data));
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(tuple_out));
+}
+
+/**
+* Remove a prepared request, or all of them when the name
+* is NULL.
+*/
+Datum http_deallocate(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(http_deallocate);
+Datum http_deallocate(PG_FUNCTION_ARGS)
+{
+	if (PG_ARGISNULL(0))
+	{
+		HASH_SEQ_STATUS status;
+		http_template *tmpl;
+
+		if (!g_templates)
+			PG_RETURN_VOID();
+
+		hash_seq_init(&status, g_templates);
+		while ((tmpl = hash_seq_search(&status)) != NULL)
+		{
+			http_template_release(tmpl);
+			hash_search(g_templates, tmpl->name, HASH_REMOVE, NULL);
+		}
+	}
+	else
+	{
+		http_template *tmpl = http_template_lookup(text_to_cstring(PG_GETARG_TEXT_PP(0)), false);
+		http_template_release(tmpl);
+		hash_search(g_templates, tmpl->name, HASH_REMOVE, NULL);
+	}
+
+	PG_RETURN_VOID();
+}
+
+
+/*************************************************************************
+* Background worker request queue
+*
+* Requests are added to the http_request_queue table with
+* http_enqueue(), and picked up by background workers that
+* run them concurrently on a curl multi handle. Completed
+* responses are moved to the http_response_queue table and
+* announced with a NOTIFY on the 'http_response' channel.
+*
+* Workers are only started when the extension is loaded
+* with shared_preload_libraries.
+*************************************************************************/
+
+/* A queued request in flight in a worker */
+typedef struct {
+	http_transfer xfer; /* Must be first, handle CURLOPT_PRIVATE points here */
+	int64 id;
+	MemoryContext mcxt;
+	CURLcode result;
+	long status;
+	char *content_type;
+	char *error;
+} http_worker_job;
+
+/* Shared state, so enqueuing backends can wake the workers */
+typedef struct {
+	slock_t mutex;
+	Latch *latches[FLEXIBLE_ARRAY_MEMBER];
+} http_worker_shared;
+
+static http_worker_shared *g_worker_shared = NULL;
+static bool g_worker_wakeup_pending = false;
+static bool g_worker_xact_callback = false;
+
+/* GUC variables */
+static int http_worker_count = 0;
+static char *http_worker_database = NULL;
+static int http_worker_max_inflight = 100;
+static int http_worker_naptime = 1000;
+static int http_worker_max_attempts = 3;
+
+/* Worker-local state */
+static int g_worker_slot = -1;
+static CURLM *g_worker_multi = NULL;
+static List *g_worker_jobs = NIL;
+static MemoryContext g_worker_context = NULL;
+
+static Size
+http_worker_shmem_size(void)
+{
+	return add_size(offsetof(http_worker_shared, latches),
+	                mul_size(sizeof(Latch *), Max(http_worker_count, 1)));
+}
+
+static void
+http_worker_shmem_startup(void)
+{
+	bool found;
+	g_worker_shared = ShmemInitStruct("pgsql-http worker",
+	                                  http_worker_shmem_size(),
+	                                  &found);
+	if (!found)
+	{
+		memset(g_worker_shared, 0, http_worker_shmem_size());
+		SpinLockInit(&(g_worker_shared->mutex));
+	}
+}
+
+/**
+* Wake every worker once the enqueuing transaction has
+* committed, so the new rows are visible when they look.
+*/
+static void
+http_worker_xact_callback(XactEvent event, void *arg)
+{
+	int i;
+
+	if (!g_worker_wakeup_pending)
+		return;
+
+	if (event == XACT_EVENT_ABORT || event == XACT_EVENT_PARALLEL_ABORT)
+	{
+		g_worker_wakeup_pending = false;
+		return;
+	}
+
+	if (event != XACT_EVENT_COMMIT && event != XACT_EVENT_PARALLEL_COMMIT)
+		return;
+
+	g_worker_wakeup_pending = false;
+	if (!g_worker_shared)
+		return;
+
+	SpinLockAcquire(&(g_worker_shared->mutex));
+	for (i = 0; i < http_worker_count; i++)
+	{
+		if (g_worker_shared->latches[i])
+			SetLatch(g_worker_shared->latches[i]);
+	}
+	SpinLockRelease(&(g_worker_shared->mutex));
+}
+
+/**
+* Look up the schema the extension is installed in, or
+* InvalidOid if it is not installed in this database.
+*/
+static Oid
+http_extension_schema(void)
+{
+	Oid extoid = get_extension_oid("http", true);
+	if (!OidIsValid(extoid))
+		return InvalidOid;
+	return get_extension_schema(extoid);
+}
+
+/**
+* Add a request to the queue for the background workers,
+* returning the queue id of the request. The response will
+* appear in http_response_queue under the same id.
+*/
+Datum http_enqueue(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(http_enqueue);
+Datum http_enqueue(PG_FUNCTION_ARGS)
+{
+	/* Declare SQL function strict, so no test for NULL input */
+	HeapTupleHeader rec = PG_GETARG_HEAPTUPLEHEADER(0);
+	Datum request = PointerGetDatum(rec);
+	Oid argtypes[1];
+	Oid schema = http_extension_schema();
+	char *sql;
+	bool isnull;
+	int64 id;
+
+	if (!OidIsValid(schema))
+		elog(ERROR, "could not lookup '%s' extension oid", "http");
+
+	argtypes[0] = HeapTupleHeaderGetTypeId(rec);
+	sql = psprintf("INSERT INTO %s.http_request_queue (request) VALUES ($1) RETURNING id",
+	               quote_identifier(get_namespace_name(schema)));
+
+	SPI_connect();
+	if (SPI_execute_with_args(sql, 1, argtypes, &request, NULL, false, 1) != SPI_OK_INSERT_RETURNING ||
+	    SPI_processed != 1)
+		elog(ERROR, "unable to add request to http_request_queue");
+	id = DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull));
+	SPI_finish();
+	pfree(sql);
+
+	/* Workers get woken up at commit */
+	if (!g_worker_xact_callback)
+	{
+		RegisterXactCallback(http_worker_xact_callback, NULL);
+		g_worker_xact_callback = true;
+	}
+	g_worker_wakeup_pending = true;
+
+	PG_RETURN_INT64(id);
+}
+
+/* Start a worker transaction for SPI access */
+static void
+http_worker_xact_begin(const char *activity)
+{
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	SPI_connect();
+	PushActiveSnapshot(GetTransactionSnapshot());
+	pgstat_report_activity(STATE_RUNNING, activity);
+}
+
+static void
+http_worker_xact_end(void)
+{
+	SPI_finish();
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+	pgstat_report_stat(false);
+	pgstat_report_activity(STATE_IDLE, NULL);
+}
 
-	if ( method != HTTP_HEAD )
-	{
-		/* Follow redirects, as many as 5 */
-		CURL_SETOPT(g_http_handle, CURLOPT_FOLLOWLOCATION, 1L);
-		CURL_SETOPT(g_http_handle, CURLOPT_MAXREDIRS, 5L);
-	}
+/*
+* Add a job that has been admitted to the multi handle, or
+* if it is marked to fail, record the failure without running
+* it.
+*/
+static void
+http_worker_start(http_worker_job *job)
+{
+	MemoryContext oldcontext = MemoryContextSwitchTo(job->mcxt);
 
-	if ( curlopt_is_set(CURLOPT_TCP_KEEPALIVE) )
+	if (job->xfer.fail_fast != CURLE_OK)
 	{
-		/* Add a keep alive option to the headers to reuse network sockets */
-		headers = curl_slist_append(headers, "Connection: Keep-Alive");
+		http_transfer_done(&(job->xfer), job->xfer.fail_fast);
+		curl_easy_cleanup(job->xfer.handle);
+		job->xfer.handle = NULL;
+		job->result = job->xfer.fail_fast;
+		job->error = pstrdup(job->xfer.error_buffer);
 	}
 	else
-	{
-		/* Add a close option to the headers to avoid open network sockets */
-		headers = curl_slist_append(headers, "Connection: close");
-	}
+		curl_multi_add_handle(g_worker_multi, job->xfer.handle);
 
-	/* Let our charset preference be known */
-	headers = curl_slist_append(headers, "Charsets: utf-8");
+	MemoryContextSwitchTo(oldcontext);
+}
 
-	/* Handle optional headers */
-	if ( ! nulls[REQ_HEADERS] )
+/**
+* Claim up to max_jobs pending requests from the queue and
+* add them to the multi handle. Rows claimed by a worker that
+* is no longer running (crashed or restarted) are claimed again,
+* until they run out of attempts.
+*/
+static int
+http_worker_claim(int max_jobs)
+{
+	Oid schema;
+	const char *nsp;
+	char *sql;
+	Oid argtypes[2] = {INT4OID, INT4OID};
+	Datum args[2];
+	uint64 i;
+	int nclaimed = 0;
+
+	http_worker_xact_begin("claiming http requests");
+
+	schema = http_extension_schema();
+	if (!OidIsValid(schema))
 	{
-		ArrayType *array = DatumGetArrayTypeP(values[REQ_HEADERS]);
-		headers = header_array_to_slist(array, headers);
+		http_worker_xact_end();
+		return 0;
 	}
 
-	/* If we have a payload we send it, assuming we're either POST, GET, PATCH, PUT or DELETE or UNKNOWN */
-	if ( ! nulls[REQ_CONTENT] && values[REQ_CONTENT] )
+	nsp = quote_identifier(get_namespace_name(schema));
+	sql = psprintf(
+		"UPDATE %s.http_request_queue "
+		"SET worker_pid = $1, started = now(), attempts = attempts + 1 "
+		"WHERE id IN ("
+		"  SELECT q.id FROM %s.http_request_queue q "
+		"  WHERE q.worker_pid IS NULL "
+		"  OR (q.worker_pid <> $1 AND NOT EXISTS ("
+		"    SELECT 1 FROM pg_catalog.pg_stat_activity a WHERE a.pid = q.worker_pid)) "
+		"  ORDER BY q.id LIMIT $2 FOR UPDATE SKIP LOCKED) "
+		"RETURNING id, request, attempts",
+		nsp, nsp);
+
+	args[0] = Int32GetDatum(MyProcPid);
+	args[1] = Int32GetDatum(max_jobs);
+	if (SPI_execute_with_args(sql, 2, argtypes, args, NULL, false, 0) != SPI_OK_UPDATE_RETURNING)
+		elog(ERROR, "unable to claim requests from http_request_queue");
+
+	for (i = 0; i < SPI_processed; i++)
 	{
-		text *content_text;
-		long content_size;
-		char *cstr;
-		char buffer[1024];
-
-		/* Read the content type */
-		if ( nulls[REQ_CONTENT_TYPE] || ! values[REQ_CONTENT_TYPE] )
-			elog(ERROR, "http_request.content_type is NULL");
-		cstr = TextDatumGetCString(values[REQ_CONTENT_TYPE]);
-
-		/* Add content type to the headers */
-		snprintf(buffer, sizeof(buffer), "Content-Type: %s", cstr);
-		headers = curl_slist_append(headers, buffer);
-		pfree(cstr);
-
-		/* Read the content */
-		content_text = DatumGetTextP(values[REQ_CONTENT]);
-		content_size = VARSIZE_ANY_EXHDR(content_text);
-
-		if ( method == HTTP_GET || method == HTTP_POST || method == HTTP_DELETE )
+		HeapTuple tup = SPI_tuptable->vals[i];
+		TupleDesc desc = SPI_tuptable->tupdesc;
+		bool isnull;
+		int64 id = DatumGetInt64(SPI_getbinval(tup, desc, 1, &isnull));
+		Datum request = SPI_getbinval(tup, desc, 2, &isnull);
+		int32 attempts = DatumGetInt32(SPI_getbinval(tup, desc, 3, &isnull));
+		MemoryContext jobcontext, oldcontext;
+		http_worker_job *job;
+
+		/* Each job gets its own context, to be dropped when it completes */
+		jobcontext = AllocSetContextCreate(g_worker_context, "pgsql-http job", ALLOCSET_DEFAULT_SIZES);
+		oldcontext = MemoryContextSwitchTo(jobcontext);
+		job = palloc0(sizeof(http_worker_job));
+		job->id = id;
+		job->mcxt = jobcontext;
+
+		if (attempts > http_worker_max_attempts)
 		{
-			/* Add the content to the payload */
-			CURL_SETOPT(g_http_handle, CURLOPT_POST, 1L);
-			if ( method == HTTP_GET )
+			/* Record the failure without running it again */
+			job->result = CURLE_FAILED_INIT;
+			job->error = psprintf("request abandoned after %d attempts", attempts - 1);
+		}
+		else
+		{
+			ResourceOwner oldowner = CurrentResourceOwner;
+
+			/* The request must outlive the SPI tuple table */
+			request = datumCopy(request, false, -1);
+
+			/*
+			* A malformed request should be recorded as failed,
+			* not take the worker (and the claim) down with it.
+			*/
+			BeginInternalSubTransaction(NULL);
+			MemoryContextSwitchTo(jobcontext);
+			PG_TRY();
 			{
-				/* Force the verb to be GET */
-				CURL_SETOPT(g_http_handle, CURLOPT_CUSTOMREQUEST, "GET");
+				job->xfer.handle = curl_easy_init();
+				if (!job->xfer.handle)
+					ereport(ERROR, (errmsg("Unable to initialize CURL")));
+				http_handle_init(job->xfer.handle);
+				http_transfer_setup(&(job->xfer), DatumGetHeapTupleHeader(request));
+
+				/* One held back by its rate limit is started later, by http_worker_perform() */
+				if (http_transfer_admit_nowait(&(job->xfer)))
+					http_worker_start(job);
+
+				ReleaseCurrentSubTransaction();
+				MemoryContextSwitchTo(jobcontext);
+				CurrentResourceOwner = oldowner;
 			}
-			else if( method == HTTP_DELETE )
+			PG_CATCH();
 			{
-				/* Force the verb to be DELETE */
-				CURL_SETOPT(g_http_handle, CURLOPT_CUSTOMREQUEST, "DELETE");
+				ErrorData *edata;
+
+				MemoryContextSwitchTo(jobcontext);
+				edata = CopyErrorData();
+				FlushErrorState();
+				RollbackAndReleaseCurrentSubTransaction();
+				MemoryContextSwitchTo(jobcontext);
+				CurrentResourceOwner = oldowner;
+
+				if (job->xfer.handle)
+					curl_easy_cleanup(job->xfer.handle);
+				job->xfer.handle = NULL;
+				job->result = CURLE_FAILED_INIT;
+				job->error = edata->message;
 			}
+			PG_END_TRY();
 
-			CURL_SETOPT(g_http_handle, CURLOPT_POSTFIELDS, (char *)(VARDATA(content_text)));
-			CURL_SETOPT(g_http_handle, CURLOPT_POSTFIELDSIZE, content_size);
+			if (job->xfer.handle)
+				nclaimed++;
 		}
-		else if ( method == HTTP_PUT || method == HTTP_PATCH || method == HTTP_UNKNOWN )
-		{
-			if ( method == HTTP_PATCH )
-				CURL_SETOPT(g_http_handle, CURLOPT_CUSTOMREQUEST, "PATCH");
 
-			/* Assume the user knows what they are doing and pass unchanged */
-			if ( method == HTTP_UNKNOWN )
-				CURL_SETOPT(g_http_handle, CURLOPT_CUSTOMREQUEST, method_str);
+		MemoryContextSwitchTo(g_worker_context);
+		g_worker_jobs = lappend(g_worker_jobs, job);
+		MemoryContextSwitchTo(oldcontext);
+	}
 
-			initStringInfo(&si_read);
-			appendBinaryStringInfo(&si_read, VARDATA(content_text), content_size);
-			CURL_SETOPT(g_http_handle, CURLOPT_UPLOAD, 1L);
-			CURL_SETOPT(g_http_handle, CURLOPT_READFUNCTION, http_readback);
-			CURL_SETOPT(g_http_handle, CURLOPT_READDATA, &si_read);
-			CURL_SETOPT(g_http_handle, CURLOPT_INFILESIZE, content_size);
+	http_worker_xact_end();
+	return nclaimed;
+}
+
+/**
+* Move completed jobs into the response queue and notify
+* any listeners of their ids.
+*/
+static void
+http_worker_finish(List *done)
+{
+	Oid schema;
+	const char *nsp;
+	char *sql;
+	Oid argtypes[3];
+	TupleDesc resp_tupdesc;
+	ListCell *lc;
+
+	http_worker_xact_begin("storing http responses");
+
+	schema = http_extension_schema();
+	if (!OidIsValid(schema))
+	{
+		http_worker_xact_end();
+		return;
+	}
+
+	nsp = quote_identifier(get_namespace_name(schema));
+	resp_tupdesc = typname_get_tupledesc("http", "http_response");
+	sql = psprintf(
+		"WITH done AS ("
+		"  DELETE FROM %s.http_request_queue WHERE id = $1 "
+		"  RETURNING id, request, attempts, created) "
+		"INSERT INTO %s.http_response_queue (id, request, response, error, attempts, created) "
+		"SELECT id, request, $2, $3, attempts, created FROM done",
+		nsp, nsp);
+	argtypes[0] = INT8OID;
+	argtypes[1] = resp_tupdesc->tdtypeid;
+	argtypes[2] = TEXTOID;
+
+	foreach(lc, done)
+	{
+		http_worker_job *job = (http_worker_job *) lfirst(lc);
+		Datum args[3];
+		char nulls[3] = {' ', ' ', ' '};
+		Datum notify_args[1];
+		Oid notify_argtypes[1] = {INT8OID};
+
+		args[0] = Int64GetDatum(job->id);
+		if (job->result == CURLE_OK)
+		{
+			HeapTuple resp = http_response_form_tuple(resp_tupdesc, job->status, job->content_type,
+			                                          &(job->xfer.si_headers), &(job->xfer.si_data));
+			args[1] = HeapTupleGetDatum(resp);
+			args[2] = (Datum) 0;
+			nulls[2] = 'n';
 		}
 		else
 		{
-			/* Never get here */
-			elog(ERROR, "illegal HTTP method");
+			args[1] = (Datum) 0;
+			nulls[1] = 'n';
+			args[2] = CStringGetTextDatum(job->error);
 		}
+
+		if (SPI_execute_with_args(sql, 3, argtypes, args, nulls, false, 0) != SPI_OK_INSERT)
+			elog(ERROR, "unable to store response in http_response_queue");
+
+		notify_args[0] = args[0];
+		SPI_execute_with_args("SELECT pg_catalog.pg_notify('http_response', $1::text)",
+		                      1, notify_argtypes, notify_args, NULL, false, 0);
 	}
-	else if ( method == HTTP_DELETE )
-	{
-		CURL_SETOPT(g_http_handle, CURLOPT_CUSTOMREQUEST, "DELETE");
-	}
-	else if ( method == HTTP_HEAD )
-	{
-		CURL_SETOPT(g_http_handle, CURLOPT_NOBODY, 1L);
-	}
-	else if ( method == HTTP_PUT || method == HTTP_POST )
+
+	ReleaseTupleDesc(resp_tupdesc);
+	http_worker_xact_end();
+}
+
+/**
+* Run the transfers on the multi handle for a while, and
+* harvest the ones that are complete.
+*/
+static void
+http_worker_perform(void)
+{
+	int still_running = 0;
+	int msgs_left = 0;
+	CURLMsg *msg;
+	CURLMcode mcode;
+	List *done = NIL;
+	ListCell *lc;
+	long timeout_ms = 100;
+	bool deferred = false;
+
+	/* Start the jobs held back by their rate limits, once they may run */
+	foreach(lc, g_worker_jobs)
 	{
-		/* If we had a content we do not reach that part */
-		elog(ERROR, "http_request.content is NULL");
-	}
-	else if ( method == HTTP_UNKNOWN ){
-		/* Assume the user knows what they are doing and pass unchanged */
-		CURL_SETOPT(g_http_handle, CURLOPT_CUSTOMREQUEST, method_str);
+		http_worker_job *job = (http_worker_job *) lfirst(lc);
+
+		if (!job->xfer.handle || !job->xfer.deferred)
+			continue;
+		if (job->xfer.admit_at <= GetCurrentTimestamp() && http_transfer_admit_nowait(&(job->xfer)))
+			http_worker_start(job);
+		else
+		{
+			timeout_ms = http_transfer_admit_timeout(&(job->xfer), timeout_ms);
+			deferred = true;
+		}
 	}
 
-	pfree(method_str);
-	/* Set the headers */
-	CURL_SETOPT(g_http_handle, CURLOPT_HTTPHEADER, headers);
+	mcode = curl_multi_perform(g_worker_multi, &still_running);
+	if (mcode == CURLM_OK && still_running)
+		mcode = curl_multi_wait(g_worker_multi, NULL, 0, (int) timeout_ms, NULL);
+	if (mcode != CURLM_OK)
+		ereport(ERROR, (errmsg("%s", curl_multi_strerror(mcode))));
 
-#if PG_VERSION_NUM >= 170000
-	/* Set up wait event tracking */
-	pgstat_report_wait_start(wait_event_transfer);
-#endif
+	/* With nothing running, sleep until a held back job may start */
+	if (!still_running && deferred && timeout_ms > 0)
+		(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+		                 timeout_ms, wait_event_rate_limit);
 
-	/*************************************************************************
-	* PERFORM THE REQUEST!
-	**************************************************************************/
-	http_return = curl_easy_perform(g_http_handle);
+	while ((msg = curl_multi_info_read(g_worker_multi, &msgs_left)))
+	{
+		http_worker_job *job = NULL;
+		MemoryContext oldcontext;
+		char *content_type = NULL;
 
-#if PG_VERSION_NUM >= 170000
-	pgstat_report_wait_end();
-#endif
+		if (msg->msg != CURLMSG_DONE)
+			continue;
 
-	elog(DEBUG2, "pgsql-http: queried '%s'", uri);
-	elog(DEBUG2, "pgsql-http: http_return '%d'", http_return);
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&job);
+		oldcontext = MemoryContextSwitchTo(job->mcxt);
 
-	/* Clean up some input things we don't need anymore */
-	ReleaseTupleDesc(tup_desc);
-	pfree(values);
-	pfree(nulls);
+		job->result = msg->data.result;
+		http_transfer_done(&(job->xfer), job->result);
+		if (job->result == CURLE_OK)
+		{
+			curl_easy_getinfo(job->xfer.handle, CURLINFO_RESPONSE_CODE, &(job->status));
+			curl_easy_getinfo(job->xfer.handle, CURLINFO_CONTENT_TYPE, &content_type);
+			if (content_type)
+				job->content_type = pstrdup(content_type);
+		}
+		else
+		{
+			job->error = pstrdup(strlen(job->xfer.error_buffer) > 0 ?
+			                     job->xfer.error_buffer :
+			                     curl_easy_strerror(job->result));
+		}
+		elog(DEBUG2, "pgsql-http: worker queried '%s', http_return '%d'", job->xfer.uri, job->result);
 
-	/*************************************************************************
-	* Create an http_response object from the curl results
-	*************************************************************************/
+		curl_multi_remove_handle(g_worker_multi, job->xfer.handle);
+		curl_easy_cleanup(job->xfer.handle);
+		job->xfer.handle = NULL;
+		MemoryContextSwitchTo(oldcontext);
+	}
 
-	/* Write out an error on failure */
-	if ( http_return != CURLE_OK )
+	/* Collect the completed jobs, including those never run */
+	foreach(lc, g_worker_jobs)
 	{
-		curl_slist_free_all(headers);
-		curl_easy_cleanup(g_http_handle);
-		g_http_handle = NULL;
+		http_worker_job *job = (http_worker_job *) lfirst(lc);
+		if (!job->xfer.handle)
+			done = lappend(done, job);
+	}
 
-#if LIBCURL_VERSION_NUM >= 0x072700 /* 7.39.0 */
-		/*
-		* If the request was aborted by an interrupt request
-		* report back.
-		*/
-		if (http_return == CURLE_ABORTED_BY_CALLBACK)
-			elog(ERROR, "canceling statement due to user request");
-#endif
+	if (done == NIL)
+		return;
 
-		http_error(http_return, http_error_buffer);
-	}
+	http_worker_finish(done);
 
-	/* Read the metadata from the handle directly */
-	if ( (CURLE_OK != curl_easy_getinfo(g_http_handle, CURLINFO_RESPONSE_CODE, &long_status)) ||
-		 (CURLE_OK != curl_easy_getinfo(g_http_handle, CURLINFO_CONTENT_TYPE, &content_type)) )
+	foreach(lc, done)
 	{
-		curl_slist_free_all(headers);
-		curl_easy_cleanup(g_http_handle);
-		g_http_handle = NULL;
-		ereport(ERROR, (errmsg("CURL: Error in curl_easy_getinfo")));
+		http_worker_job *job = (http_worker_job *) lfirst(lc);
+		g_worker_jobs = list_delete_ptr(g_worker_jobs, job);
+		http_transfer_cleanup(&(job->xfer));
+		MemoryContextDelete(job->mcxt);
 	}
+	list_free(done);
+}
 
-	/* Prepare our return object */
-	if (get_call_result_type(fcinfo, 0, &tup_desc) != TYPEFUNC_COMPOSITE) {
-	    ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-	        errmsg("%s called with incompatible return type", __func__)));
+static void
+http_worker_shmem_exit(int code, Datum arg)
+{
+	if (g_worker_shared && g_worker_slot >= 0)
+	{
+		SpinLockAcquire(&(g_worker_shared->mutex));
+		g_worker_shared->latches[g_worker_slot] = NULL;
+		SpinLockRelease(&(g_worker_shared->mutex));
 	}
+}
 
-	ncolumns = tup_desc->natts;
-	values = palloc0(sizeof(Datum)*ncolumns);
-	nulls = palloc0(sizeof(bool)*ncolumns);
+/**
+* Entry point for the queue background workers.
+*/
+PGDLLEXPORT void
+http_worker_main(Datum main_arg)
+{
+	TimestampTz last_claim = 0;
+	bool wakeup = true;
 
-	/* Status code */
-	status = long_status;
-	values[RESP_STATUS] = Int32GetDatum(status);
-	nulls[RESP_STATUS] = false;
+	g_worker_slot = DatumGetInt32(main_arg);
+	http_wait_events_init();
 
-	/* Content type */
-	if ( content_type )
-	{
-		List *ctl;
-		ListCell *lc;
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
 
-		values[RESP_CONTENT_TYPE] = CStringGetTextDatum(content_type);
-		nulls[RESP_CONTENT_TYPE] = false;
+	BackgroundWorkerInitializeConnection(http_worker_database, NULL, 0);
 
-		/* Read the character set name out of the content type */
-		/* if there is one in there */
-		/* text/html; charset=iso-8859-1 */
-		if ( SplitIdentifierString(pstrdup(content_type), ';', &ctl) )
-		{
-			foreach(lc, ctl)
-			{
-				/* charset=iso-8859-1 */
-				const char *param = (const char *) lfirst(lc);
-				const char *paramtype = "charset=";
-				if ( http_strcasestr(param, paramtype) )
-				{
-					/* iso-8859-1 */
-					const char *charset = param + strlen(paramtype);
-					content_charset = pg_char_to_encoding(charset);
-					break;
-				}
-			}
-		}
-	}
-	else
-	{
-		values[RESP_CONTENT_TYPE] = (Datum)0;
-		nulls[RESP_CONTENT_TYPE] = true;
-	}
+	/* Let enqueuing backends find our latch */
+	SpinLockAcquire(&(g_worker_shared->mutex));
+	g_worker_shared->latches[g_worker_slot] = MyLatch;
+	SpinLockRelease(&(g_worker_shared->mutex));
+	before_shmem_exit(http_worker_shmem_exit, (Datum) 0);
 
-	/* Headers array */
-	if ( si_headers.len )
-	{
-		/* Strip the carriage-returns, because who cares? */
-		string_info_remove_cr(&si_headers);
-		values[RESP_HEADERS] = PointerGetDatum(header_string_to_array(&si_headers));
-		nulls[RESP_HEADERS] = false;
-	}
-	else
+	g_worker_context = AllocSetContextCreate(TopMemoryContext, "pgsql-http worker", ALLOCSET_DEFAULT_SIZES);
+	g_worker_multi = curl_multi_init();
+	if (!g_worker_multi)
+		ereport(ERROR, (errmsg("Unable to initialize CURL multi handle")));
+	http_pool_multi_init(g_worker_multi);
+
+	/* Release anything a previous worker with our pid left claimed */
+	http_worker_xact_begin("releasing http requests");
+	if (OidIsValid(http_extension_schema()))
 	{
-		values[RESP_HEADERS] = (Datum)0;
-		nulls[RESP_HEADERS] = true;
+		Oid argtypes[1] = {INT4OID};
+		Datum args[1];
+		char *sql = psprintf("UPDATE %s.http_request_queue SET worker_pid = NULL WHERE worker_pid = $1",
+		                     quote_identifier(get_namespace_name(http_extension_schema())));
+		args[0] = Int32GetDatum(MyProcPid);
+		SPI_execute_with_args(sql, 1, argtypes, args, NULL, false, 0);
 	}
+	http_worker_xact_end();
 
-	/* Content */
-	if ( si_data.len )
+	elog(LOG, "pgsql-http worker %d started on database '%s'", g_worker_slot, http_worker_database);
+
+	for (;;)
 	{
-		char *content_str;
-		size_t content_len;
-		elog(DEBUG2, "pgsql-http: content_charset = %d", content_charset);
+		int ninflight = list_length(g_worker_jobs);
 
-		/* Apply character transcoding if necessary */
-		if ( content_charset < 0 )
+		CHECK_FOR_INTERRUPTS();
+
+		if (ConfigReloadPending)
 		{
-			content_str = si_data.data;
-			content_len = si_data.len;
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
 		}
-		else
+
+		/* Look for new work when woken, or every naptime */
+		if (ninflight < http_worker_max_inflight &&
+		    (wakeup || TimestampDifferenceExceeds(last_claim, GetCurrentTimestamp(), http_worker_naptime)))
 		{
-			content_str = pg_any_to_server(si_data.data, si_data.len, content_charset);
-			content_len = strlen(content_str);
+			ninflight += http_worker_claim(http_worker_max_inflight - ninflight);
+			last_claim = GetCurrentTimestamp();
+			wakeup = false;
 		}
 
-		values[RESP_CONTENT] = PointerGetDatum(cstring_to_text_with_len(content_str, content_len));
-		nulls[RESP_CONTENT] = false;
-	}
-	else
-	{
-		values[RESP_CONTENT] = (Datum)0;
-		nulls[RESP_CONTENT] = true;
+		if (g_worker_jobs != NIL)
+		{
+			int rc;
+			http_worker_perform();
+
+			/* Check the latch without sleeping, we have transfers to run */
+			rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH, 0, wait_event_worker);
+			if (rc & WL_LATCH_SET)
+			{
+				ResetLatch(MyLatch);
+				wakeup = true;
+			}
+		}
+		else
+		{
+			int rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+			                   http_worker_naptime, wait_event_worker);
+			if (rc & WL_LATCH_SET)
+			{
+				ResetLatch(MyLatch);
+				wakeup = true;
+			}
+		}
 	}
+}
 
-	/* Build up a tuple from values/nulls lists */
-	tuple_out = heap_form_tuple(tup_desc, values, nulls);
+static void
+http_worker_guc_init(void)
+{
+	DefineCustomIntVariable(
+		"http.worker_count",
+		"Number of background workers running queued requests.",
+		"Requires http in shared_preload_libraries.",
+		&http_worker_count,
+		0, 0, HTTP_MAX_WORKERS,
+		PGC_POSTMASTER,
+		0, NULL, NULL, NULL);
 
-	/* Clean up */
-	ReleaseTupleDesc(tup_desc);
-	if ( ! curlopt_is_set(CURLOPT_TCP_KEEPALIVE) )
+	DefineCustomStringVariable(
+		"http.worker_database",
+		"Database the background workers read their queue from.",
+		NULL,
+		&http_worker_database,
+		"postgres",
+		PGC_POSTMASTER,
+		0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable(
+		"http.worker_max_inflight",
+		"Maximum number of requests each background worker runs at once.",
+		NULL,
+		&http_worker_max_inflight,
+		100, 1, 10000,
+		PGC_SIGHUP,
+		0, NULL, NULL, NULL);
+
+	DefineCustomIntVariable(
+		"http.worker_naptime",
+		"Time between background worker checks of an idle queue.",
+		NULL,
+		&http_worker_naptime,
+		1000, 10, INT_MAX,
+		PGC_SIGHUP,
+		GUC_UNIT_MS, NULL, NULL, NULL);
+
+	DefineCustomIntVariable(
+		"http.worker_max_attempts",
+		"Number of times a queued request is tried before it is abandoned.",
+		"Requests are only retried when the worker running them exits.",
+		&http_worker_max_attempts,
+		3, 1, INT_MAX,
+		PGC_SIGHUP,
+		0, NULL, NULL, NULL);
+}
+
+static void
+http_worker_register(void)
+{
+	int i;
+	for (i = 0; i < http_worker_count; i++)
 	{
-		curl_easy_cleanup(g_http_handle);
-		g_http_handle = NULL;
+		BackgroundWorker worker;
+		memset(&worker, 0, sizeof(worker));
+		worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+		worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+		worker.bgw_restart_time = 10;
+		snprintf(worker.bgw_library_name, BGW_MAXLEN, "http");
+		snprintf(worker.bgw_function_name, BGW_MAXLEN, "http_worker_main");
+		snprintf(worker.bgw_name, BGW_MAXLEN, "pgsql-http worker %d", i);
+		snprintf(worker.bgw_type, BGW_MAXLEN, "pgsql-http worker");
+		worker.bgw_main_arg = Int32GetDatum(i);
+		RegisterBackgroundWorker(&worker);
 	}
-	curl_slist_free_all(headers);
-	pfree(si_headers.data);
-	pfree(si_data.data);
-	pfree(values);
-	pfree(nulls);
+}
 
-	/* Return */
-	PG_RETURN_DATUM(HeapTupleGetDatum(tuple_out));
+/*************************************************************************
+* Shared memory set-up, for the features that need state
+* shared across backends.
+*************************************************************************/
+
+static Size
+http_shmem_size(void)
+{
+	Size size = 0;
+	size = add_size(size, http_worker_shmem_size());
+	size = add_size(size, http_dns_shmem_size());
+	size = add_size(size, http_cache_shmem_size());
+	size = add_size(size, http_rate_shmem_size());
+	size = add_size(size, http_circuit_shmem_size());
+	size = add_size(size, http_stats_shmem_size());
+	return size;
+}
+
+static void
+http_shmem_request(void)
+{
+#if PG_VERSION_NUM >= 150000
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+#endif
+	RequestAddinShmemSpace(http_shmem_size());
+	http_dns_shmem_request();
+	http_cache_shmem_request();
+	http_rate_shmem_request();
+	http_circuit_shmem_request();
+	http_stats_shmem_request();
 }
 
+static void
+http_shmem_startup(void)
+{
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	http_worker_shmem_startup();
+	http_dns_shmem_startup();
+	http_cache_shmem_startup();
+	http_rate_shmem_startup();
+	http_circuit_shmem_startup();
+	http_stats_shmem_startup();
+	LWLockRelease(AddinShmemInitLock);
+}
 
 
 
@@ -1693,17 +7400,7 @@ Datum urlencode_jsonb(PG_FUNCTION_ARGS)
 			key_enc = urlencode_cstr(v.val.string.val, v.val.string.len);
 
 			/* Read the value for this key */
-#if PG_VERSION_NUM < 130000
-			{
-				JsonbValue  k;
-				k.type = jbvString;
-				k.val.string.val = key;
-				k.val.string.len = strlen(key);
-				v = *findJsonbValueFromContainer(&jb->root, JB_FOBJECT, &k);
-			}
-#else
 			getKeyJsonValueFromContainer(&jb->root, key, strlen(key), &v);
-#endif
 			/* Read and encode the value */
  			switch(v.type)
  			{
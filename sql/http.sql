@@ -26,6 +26,30 @@ FROM (
 ) a
 WHERE field ILIKE 'Abcde';
 
+-- Headers parse the same with CRLF and LF line ends
+SELECT http_parse_headers(E'HTTP/1.1 200 OK\r\nA: 1\r\nB:\r\nC: x\r\n  y\r\n\r\n')
+     = http_parse_headers(E'HTTP/1.1 200 OK\nA: 1\nB:\nC: x\n  y\n\n') AS same;
+
+-- Empty values are kept and folded lines joined
+SELECT * FROM unnest(http_parse_headers(E'HTTP/1.1 200 OK\nA: 1\nB:\nC: x\n  y\n\n'));
+
+-- Only the headers of the final response are kept
+SELECT * FROM unnest(http_parse_headers(E'HTTP/1.1 302 Found\r\nLocation: /x\r\n\r\nHTTP/1.1 200 OK\r\nX-Final: yes\r\n\r\n'));
+
+-- Empty header value
+SELECT lower(field) AS field, value = '' AS empty
+FROM (
+	SELECT (unnest(headers)).*
+	FROM http_get(current_setting('http.server_host') || '/response-headers?X-Empty=')
+) a
+WHERE field ILIKE 'X-Empty';
+
+-- Headers after a redirect
+SELECT status, lower(h.field) AS field, h.value
+FROM http_get(current_setting('http.server_host') || '/redirect-to?url=' || urlencode('/response-headers?X-Final=yes')) r,
+	unnest(r.headers) h
+WHERE lower(h.field) IN ('location', 'x-final');
+
 -- GET
 SELECT status,
 content::json->'args'->>'foo' AS args,
@@ -69,6 +93,12 @@ replace(content::json->>'url', current_setting('http.server_host'),'') AS path,
 content::json->>'method' AS method
 FROM http_put(current_setting('http.server_host') || '/anything?foo=bar','payload','text/plain');
 
+-- PUT with a bytea body
+SELECT status,
+content::json->>'data' AS data,
+content::json->>'method' AS method
+FROM http_put(current_setting('http.server_host') || '/anything', 'payload'::bytea, 'application/octet-stream');
+
 -- PATCH
 SELECT status,
 content::json->>'data' AS data,
@@ -127,6 +157,144 @@ SELECT
 FROM http, headers
 WHERE field ilike 'Content-Type';
 
+-- Binary content
+SELECT status, content_type, length(content) AS length_binary
+FROM http_get_bytea(current_setting('http.server_host') || '/image/png');
+
+-- Large objects
+SELECT length(lo_get(lo)) AS length_binary, lo_unlink(lo)
+FROM http_get_lo(current_setting('http.server_host') || '/image/png') AS lo;
+SELECT status, content::json->>'data' AS data, lo_unlink(lo)
+FROM lo_from_bytea(0, 'payload') AS lo,
+     http_put_lo(current_setting('http.server_host') || '/anything', lo, 'text/plain');
+
+-- Concurrent requests
+SELECT ordinality, (response).status
+FROM http_multi(ARRAY[
+	('GET', current_setting('http.server_host') || '/status/200', NULL, NULL, NULL),
+	('GET', current_setting('http.server_host') || '/status/202', NULL, NULL, NULL),
+	('DELETE', current_setting('http.server_host') || '/status/204', NULL, NULL, NULL)
+]::http_request[], 2)
+ORDER BY ordinality;
+
+-- Queue a request for the background workers
+SELECT http_enqueue(('GET', current_setting('http.server_host') || '/status/200', NULL, NULL, NULL)) > 0 AS queued;
+SELECT (request).method, attempts FROM http_request_queue;
+
+-- Pooled connections are reused
+SET http.pool_enabled = on;
+SELECT status FROM http_get(current_setting('http.server_host') || '/status/200');
+SELECT status FROM http_get(current_setting('http.server_host') || '/status/200');
+SELECT pooled, connections_reused > 0 AS reused FROM http_pool_stats();
+RESET http.pool_enabled;
+
+-- Keep to HTTP/1.1
+SET http.http_version = '1.1';
+SELECT status FROM http_get(current_setting('http.server_host') || '/status/200');
+RESET http.http_version;
+
+-- Parallel-safe reads, with options set by function visible as settings
+SELECT current_setting('http.curlopt_timeout');
+SELECT status FROM http_get_parallel(current_setting('http.server_host') || '/status/200');
+SELECT status FROM http_parallel(('POST', current_setting('http.server_host') || '/post', NULL, NULL, NULL)::http_request);
+
+-- Retries give back the last response
+SET http.retry_initial_delay = 10;
+SELECT status FROM http(('GET', current_setting('http.server_host') || '/status/503', NULL, NULL, NULL)::http_request, 2);
+RESET http.retry_initial_delay;
+
+-- Statistics per host
+SELECT http_stats_reset();
+SELECT status FROM http_get(current_setting('http.server_host') || '/status/200');
+SELECT status FROM http_get(current_setting('http.server_host') || '/status/404');
+SELECT requests, status_2xx, status_4xx, errors, bytes_received > 0 AS received
+FROM pg_stat_http;
+
+-- Timing of the last request
+SELECT uri LIKE '%/status/404' AS uri, total_time >= connect_time AS ordered,
+       bytes_received > 0 AS received, http_version
+FROM http_last_timing();
+-- No more hosts are tracked than there is room for
+DO $$
+BEGIN
+  FOR i IN 0..299 LOOP
+    BEGIN
+      PERFORM http_get('http://127.0.' || (i / 250) || '.' || (1 + i % 250) || ':1/');
+    EXCEPTION WHEN OTHERS THEN
+      NULL;
+    END;
+  END LOOP;
+END;
+$$;
+SELECT count(*) FROM pg_stat_http;
+SELECT http_stats_reset();
+
+-- Streamed responses
+SELECT count(*) FROM http_get_lines(current_setting('http.server_host') || '/stream/5');
+SELECT length(chunk)
+FROM http_stream(('GET', current_setting('http.server_host') || '/range/1000', NULL, NULL, NULL), 400) AS chunk;
+SELECT r->'id' AS id FROM http_get_ndjson(current_setting('http.server_host') || '/stream/3') AS r;
+-- Blank lines of a CRLF stream are passed over too
+SELECT r->'id' AS id
+FROM http_get_ndjson(current_setting('http.server_host') || '/base64/' ||
+  translate(encode(convert_to(E'{"id":1}\r\n\r\r\n \r\n{"id":2}\r\n', 'UTF8'), 'base64'), '+/', '-_')) AS r;
+
+-- Response size limits, and spilling large responses to a file
+SET http.max_response_bytes = 100;
+DO $$
+BEGIN
+    PERFORM http_get(current_setting('http.server_host') || '/range/1000');
+EXCEPTION
+    WHEN OTHERS THEN
+        RAISE WARNING '%', regexp_replace(SQLERRM, ' from .* is ', ' is ');
+END;
+$$;
+DO $$
+BEGIN
+    PERFORM http_get(current_setting('http.server_host') || '/stream-bytes/1000?chunk_size=50');
+EXCEPTION
+    WHEN OTHERS THEN
+        RAISE WARNING '%', regexp_replace(SQLERRM, ' from .* is ', ' is ');
+END;
+$$;
+RESET http.max_response_bytes;
+SET http.spill_threshold = 1;
+SELECT length(content) FROM http_get(current_setting('http.server_host') || '/range/5000');
+RESET http.spill_threshold;
+
+-- Response cache is off unless preloaded and sized
+SELECT entries, hits, stores FROM http_cache_stats();
+
+-- Revalidated responses
+SELECT status FROM http_get_cached(current_setting('http.server_host') || '/etag/abc');
+-- Mark the stored response, to see it come back from a 304
+UPDATE http_response_cache SET response.content = 'cached';
+SELECT status, content FROM http_get_cached(current_setting('http.server_host') || '/etag/abc');
+SELECT owner = current_user AS own, etag FROM http_response_cache;
+-- Other roles have caches of their own
+CREATE ROLE regress_http_cache;
+SET ROLE regress_http_cache;
+SELECT status, content = 'cached' AS cached FROM http_get_cached(current_setting('http.server_host') || '/etag/abc');
+SELECT count(*) FROM http_response_cache;
+RESET ROLE;
+SELECT count(*) FROM http_response_cache;
+DELETE FROM http_response_cache;
+DROP ROLE regress_http_cache;
+
+-- Prepared requests
+SELECT http_prepare('echo', ('POST', current_setting('http.server_host') || '/anything', ARRAY[http_header('X-Template', 'yes')], 'text/plain', 'template')::http_request);
+SELECT status,
+replace(content::json->>'url',current_setting('http.server_host'),'') AS path,
+content::json->>'data' AS data,
+content::json->'headers'->>'X-Template' AS header
+FROM http_execute('echo', '/one', 'first');
+SELECT status,
+replace(content::json->>'url',current_setting('http.server_host'),'') AS path,
+content::json->>'data' AS data,
+content::json->'headers'->>'X-Template' AS header
+FROM http_execute('echo');
+SELECT http_deallocate('echo');
+
 -- Alter options and and reset them and throw errors
 SELECT http_set_curlopt('CURLOPT_PROXY', '127.0.0.1');
 -- Error because proxy is not there
@@ -151,6 +319,12 @@ $$;
 SELECT http_reset_curlopt();
 -- Now it should work
 SELECT status FROM http_get(current_setting('http.server_host') || '/status/555');
+-- Options set in a transaction that aborts are rolled back
+BEGIN;
+SELECT http_set_curlopt('CURLOPT_PROXYPORT', '12345');
+SHOW http.curlopt_proxyport;
+ROLLBACK;
+SHOW http.curlopt_proxyport;
 
 -- Alter the default timeout and then run a query that is longer than
 -- the default (5s), but shorter than the new timeout
@@ -0,0 +1,59 @@
+# Rate limits are set for the whole server, so they are tried
+# on a server of their own rather than in the regression tests.
+use strict;
+use warnings;
+
+use Test::More;
+
+BEGIN
+{
+	plan skip_all => 'needs PostgreSQL 15 or later for PostgreSQL::Test::Cluster'
+	  unless eval { require PostgreSQL::Test::Cluster; 1 };
+}
+
+my $node = PostgreSQL::Test::Cluster->new('rate_limits');
+$node->init;
+$node->append_conf('postgresql.conf', qq{
+http.rate_limits = 'ratelimited.invalid=1/h'
+http.rate_limit_wait = 0
+});
+$node->start;
+$node->safe_psql('postgres', q{
+CREATE EXTENSION http;
+CREATE FUNCTION try_get(uri text) RETURNS text LANGUAGE plpgsql AS $$
+BEGIN
+  PERFORM http_get(uri);
+  RETURN 'sent';
+EXCEPTION WHEN OTHERS THEN
+  RETURN CASE WHEN SQLERRM LIKE 'Rate limit%' THEN 'rate limited' ELSE 'sent' END;
+END;
+$$;
+});
+
+# Rate limits are checked when set
+my ($ret, $stdout, $stderr) = $node->psql('postgres', q{
+LOAD 'http';
+ALTER SYSTEM SET http.rate_limits = 'ratelimited.invalid=fast';
+});
+like($stderr, qr/Invalid rate limit "ratelimited.invalid=fast"/, 'bad rate limit is refused');
+
+# and hold back requests to a host once its bucket is empty,
+# in the backend's own buckets when not preloaded
+is( $node->safe_psql('postgres',
+		"SELECT string_agg(try_get('http://ratelimited.invalid/'), ', ') FROM generate_series(1, 2)"),
+	'sent, rate limited',
+	'second request of a backend is held back');
+
+# Once preloaded, the buckets are shared by all the backends
+$node->append_conf('postgresql.conf', qq{
+shared_preload_libraries = 'http'
+http.dns_cache_negative_ttl = 0
+});
+$node->restart;
+is($node->safe_psql('postgres', "SELECT try_get('http://ratelimited.invalid/')"),
+	'sent', 'first request is sent');
+is($node->safe_psql('postgres', "SELECT try_get('http://ratelimited.invalid/')"),
+	'rate limited', 'request from another backend is held back');
+
+$node->stop;
+done_testing();
@@ -0,0 +1,81 @@
+# The circuit breakers are set up for the whole server, so they
+# are tried on a server of their own rather than in the
+# regression tests. Requests go to a closed port of the
+# loopback addresses, and fail at once.
+use strict;
+use warnings;
+
+use Test::More;
+
+BEGIN
+{
+	plan skip_all => 'needs PostgreSQL 15 or later for PostgreSQL::Test::Cluster'
+	  unless eval { require PostgreSQL::Test::Cluster; 1 };
+}
+
+my $node = PostgreSQL::Test::Cluster->new('circuit_breakers');
+$node->init;
+$node->append_conf('postgresql.conf', qq{
+shared_preload_libraries = 'http'
+http.circuit_failure_threshold = 2
+});
+$node->start;
+$node->safe_psql('postgres', q{
+CREATE EXTENSION http;
+CREATE FUNCTION try_get(uri text) RETURNS text LANGUAGE plpgsql AS $$
+BEGIN
+  RETURN (http_get(uri)).status::text;
+EXCEPTION WHEN OTHERS THEN
+  RETURN CASE WHEN SQLERRM LIKE 'Circuit open%' THEN 'circuit open' ELSE 'failed' END;
+END;
+$$;
+});
+
+my $down = 'http://127.0.0.1:1/';
+
+# The settings are the server's, not the session's
+my ($ret, $stdout, $stderr) = $node->psql('postgres',
+	'SET http.circuit_failure_threshold = 1');
+like($stderr, qr/cannot be changed now/, 'threshold cannot be set by a session');
+
+# A session with a timeout of its own has no say in the circuits
+is( $node->safe_psql('postgres', qq{
+SELECT http_set_curlopt('CURLOPT_CONNECTTIMEOUT_MS', '500');
+SELECT string_agg(try_get('$down'), ', ') FROM generate_series(1, 3);
+}),
+	"t\nfailed, failed, failed",
+	'failures with changed timeouts are not counted');
+is($node->safe_psql('postgres', 'SELECT count(*) FROM http_circuit_state'),
+	'0', 'no circuit for failures with changed timeouts');
+
+# Otherwise the circuit opens after repeated failures
+is( $node->safe_psql('postgres',
+		"SELECT string_agg(try_get('$down'), ', ') FROM generate_series(1, 3)"),
+	'failed, failed, circuit open',
+	'circuit opens after repeated failures');
+is($node->safe_psql('postgres', 'SELECT state, failures FROM http_circuit_state'),
+	'open|2', 'open circuit is shown');
+
+# and other sessions are answered with the fallback status
+is( $node->safe_psql('postgres', qq{
+SET http.circuit_fallback_status = 599;
+SELECT status FROM http_get('$down');
+}),
+	'599',
+	'open circuit answers with the fallback status');
+
+$node->safe_psql('postgres', 'SELECT http_circuit_reset()');
+is($node->safe_psql('postgres', 'SELECT count(*) FROM http_circuit_state'),
+	'0', 'circuit is closed by hand');
+
+# No more hosts are tracked than there is room for
+is( $node->safe_psql('postgres', q{
+SELECT count(try_get('http://127.0.' || (i / 250) || '.' || (1 + i % 250) || ':1/'))
+FROM generate_series(0, 299) AS i;
+SELECT count(*) FROM http_circuit_state;
+}),
+	"300\n256",
+	'circuit table is capped');
+
+$node->stop;
+done_testing();
@@ -0,0 +1,32 @@
+# http_reset_curlopt() puts options back to their configured
+# values, which needs a server configured for the purpose.
+use strict;
+use warnings;
+
+use Test::More;
+
+BEGIN
+{
+	plan skip_all => 'needs PostgreSQL 15 or later for PostgreSQL::Test::Cluster'
+	  unless eval { require PostgreSQL::Test::Cluster; 1 };
+}
+
+my $node = PostgreSQL::Test::Cluster->new('curlopt_reset');
+$node->init;
+$node->append_conf('postgresql.conf', qq{
+http.curlopt_proxyport = '3128'
+});
+$node->start;
+$node->safe_psql('postgres', 'CREATE EXTENSION http');
+
+is( $node->safe_psql('postgres', q{
+SELECT http_set_curlopt('CURLOPT_PROXYPORT', '12345');
+SHOW http.curlopt_proxyport;
+SELECT http_reset_curlopt();
+SHOW http.curlopt_proxyport;
+}),
+	"t\n12345\nt\n3128",
+	'reset goes back to the configured value');
+
+$node->stop;
+done_testing();